@@ -11,7 +11,7 @@ if [ "$1" != "" ]; then
       exit 1
     fi
     llc output.ll -o output.s
-    clang output.s lib.a -o output.out
+    clang output.s runtime/libpclrt.a -lm lib.a -o output.out
     echo "Executing output"
     ./output.out
 else
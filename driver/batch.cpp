@@ -0,0 +1,74 @@
+#include "driver.hpp"
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+#include <llvm/Config/llvm-config.h>
+#include <llvm/Support/FileSystem.h>
+#include "../semantic/options.hpp"
+
+#if LLVM_VERSION_MAJOR >= 9
+#define PCL_OF_NONE llvm::sys::fs::OF_None
+#else
+#define PCL_OF_NONE llvm::sys::fs::F_None
+#endif
+
+// Every worker thread is a complete compiler: the symbol table, the LLVM
+// context and builder are thread_local and each parse has its own
+// reentrant scanner, so the threads share nothing but the work queue.
+
+static std::string output_name(const std::string &file) {
+  size_t dot = file.rfind('.');
+  size_t slash = file.rfind('/');
+  if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+    return file + ".ll";
+  return file.substr(0, dot) + ".ll";
+}
+
+int run_batch(unsigned jobs, const std::vector<std::string> &files) {
+  std::atomic<size_t> next(0);
+  std::atomic<int> failures(0);
+  std::mutex report;
+  // Options are per thread, the workers compile with the ones pcl was given.
+  Options shared = opts;
+
+  auto worker = [&]() {
+    opts = shared;
+    for (size_t i = next++; i < files.size(); i = next++) {
+      const std::string &file = files[i];
+      std::ostringstream diagnostics;
+      bool ok = false;
+      FILE *in = fopen(file.c_str(), "r");
+      if (!in) {
+        diagnostics << strerror(errno) << std::endl;
+      }
+      else {
+        std::error_code error;
+        std::string output = output_name(file);
+        llvm::raw_fd_ostream out(output, error, PCL_OF_NONE);
+        if (error) diagnostics << output << ": " << error.message() << std::endl;
+        else ok = compile_program(in, out, diagnostics);
+        fclose(in);
+        if (!ok && !error) llvm::sys::fs::remove(output);
+      }
+      if (!ok) {
+        failures++;
+        std::lock_guard<std::mutex> lock(report);
+        std::cerr << file << ":\n" << diagnostics.str() << std::flush;
+      }
+    }
+  };
+
+  if (jobs == 0) jobs = 1;
+  if (jobs > files.size()) jobs = files.size();
+  std::vector<std::thread> pool;
+  for (unsigned j = 1; j < jobs; j++) pool.push_back(std::thread(worker));
+  worker();
+  for (std::thread &t : pool) t.join();
+  return failures ? 1 : 0;
+}
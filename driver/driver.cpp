@@ -0,0 +1,438 @@
+#include "driver.hpp"
+#include "../semantic/ast.hpp"
+
+#include <llvm/Config/llvm-config.h>
+#include <llvm/Analysis/TargetLibraryInfo.h>
+#include <llvm/Analysis/TargetTransformInfo.h>
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/xxhash.h>
+#include <llvm/Support/TargetSelect.h>
+#include <llvm/Target/TargetMachine.h>
+#include <llvm/Target/TargetOptions.h>
+#include <llvm/Transforms/Vectorize.h>
+#include <llvm/Support/Host.h>
+#if LLVM_VERSION_MAJOR >= 14
+#include <llvm/MC/TargetRegistry.h>
+#else
+#include <llvm/Support/TargetRegistry.h>
+#endif
+
+#include "../parser/parser.hpp"
+
+static bool initialize_target() {
+  InitializeNativeTarget();
+  InitializeNativeTargetAsmPrinter();
+  return true;
+}
+
+// A machine for the host, with the module set up for it. nullptr after a
+// diagnostic when there is none.
+static std::unique_ptr<TargetMachine> native_machine(Module &M) {
+  // Runs once, even with several threads compiling.
+  static bool initialized = initialize_target();
+  (void)initialized;
+  std::string triple = sys::getDefaultTargetTriple();
+  std::string error;
+  const Target *target = TargetRegistry::lookupTarget(triple, error);
+  if (!target) {
+    diag() << error << std::endl;
+    return nullptr;
+  }
+  TargetOptions options;
+  std::unique_ptr<TargetMachine> machine(target->createTargetMachine(
+      triple, "generic", "", options, Optional<Reloc::Model>(Reloc::PIC_)));
+  M.setTargetTriple(triple);
+  M.setDataLayout(machine->createDataLayout());
+  return machine;
+}
+
+static bool emit_object(Module &M, raw_pwrite_stream &out) {
+  std::unique_ptr<TargetMachine> machine = native_machine(M);
+  if (!machine) return false;
+  std::string triple = M.getTargetTriple();
+
+  legacy::PassManager PM;
+#if LLVM_VERSION_MAJOR >= 10
+  bool unsupported = machine->addPassesToEmitFile(PM, out, nullptr, CGFT_ObjectFile);
+#elif LLVM_VERSION_MAJOR >= 7
+  bool unsupported = machine->addPassesToEmitFile(PM, out, nullptr, TargetMachine::CGFT_ObjectFile);
+#else
+  bool unsupported = machine->addPassesToEmitFile(PM, out, TargetMachine::CGFT_ObjectFile);
+#endif
+  if (unsupported) {
+    diag() << "Cannot emit object files for " << triple << std::endl;
+    return false;
+  }
+  PM.run(M);
+  return true;
+}
+
+static void write_bitcode(Module &M, raw_ostream &out) {
+#if LLVM_VERSION_MAJOR >= 7
+  WriteBitcodeToFile(M, out);
+#else
+  WriteBitcodeToFile(&M, out);
+#endif
+}
+
+// The compile cache (--cache=dir) keeps the module of every program it has
+// compiled, before it is printed and optimized, as a bitcode file named by a
+// hash of the source and of everything else the module depends on. A program
+// seen before is loaded from there, without being parsed, checked or
+// generated again.
+//
+// A changed compiler may generate differently, so the key names the code
+// generator: the Makefile passes a checksum of the sources that shape the
+// module. Built any other way, there is no cache.
+static std::string cache_path(const std::string &source) {
+#ifndef PCL_CODEGEN_HASH
+  return "";
+#else
+  std::string key = source;
+  key += '\0';
+  key += "pcl cache 3, LLVM " LLVM_VERSION_STRING ", code generator " PCL_CODEGEN_HASH;
+  key += opts.profileGenerate ? " generate" : "";
+  key += opts.profileProcedures ? " procedures" : "";
+  key += opts.profileSample ? " sample" : "";
+  key += opts.checkOverflow ? " overflow" : "";
+  if (!opts.profileUse.empty()) {
+    // The profile shapes the module, not its name.
+    ErrorOr<std::unique_ptr<MemoryBuffer>> profile = MemoryBuffer::getFile(opts.profileUse);
+    if (!profile) return "";
+    key += '\0';
+    key += (*profile)->getBuffer();
+  }
+  char name[32];
+  snprintf(name, sizeof name, "/%016llx.bc", (unsigned long long)xxHash64(key));
+  return opts.cacheDir + name;
+#endif
+}
+
+static bool cache_load(const std::string &path) {
+  ErrorOr<std::unique_ptr<MemoryBuffer>> buffer = MemoryBuffer::getFile(path);
+  if (!buffer) return false;
+  Expected<std::unique_ptr<Module>> module =
+      parseBitcodeFile((*buffer)->getMemBufferRef(), AST::TheContext);
+  if (!module) {
+    // A damaged entry is compiled again and replaced.
+    consumeError(module.takeError());
+    return false;
+  }
+  AST::TheModule = std::move(*module);
+  // Named as a fresh compile names it, so the output does not tell.
+  AST::TheModule->setModuleIdentifier("pcl program");
+  return true;
+}
+
+// Written under a unique name and renamed, so that compiles running at the
+// same time never see half a file.
+static void cache_store(const std::string &path, Module &M) {
+  if (verifyModule(M)) return;
+  sys::fs::create_directories(opts.cacheDir);
+  int fd;
+  SmallString<128> temporary;
+  if (sys::fs::createUniqueFile(path + "-%%%%%%.tmp", fd, temporary)) return;
+  {
+    raw_fd_ostream out(fd, true);
+    write_bitcode(M, out);
+  }
+  if (sys::fs::rename(temporary, path)) sys::fs::remove(temporary);
+}
+
+static bool vector_library(const std::string &name, TargetLibraryInfoImpl::VectorLibrary &lib) {
+  if (name == "SVML") lib = TargetLibraryInfoImpl::SVML;
+  else if (name == "Accelerate") lib = TargetLibraryInfoImpl::Accelerate;
+#if LLVM_VERSION_MAJOR >= 9
+  else if (name == "MASSV") lib = TargetLibraryInfoImpl::MASSV;
+#endif
+#if LLVM_VERSION_MAJOR >= 13
+  else if (name == "LIBMVEC") lib = TargetLibraryInfoImpl::LIBMVEC_X86;
+#endif
+  else return false;
+  return true;
+}
+
+// --veclib: the loops of every routine are vectorized for the host target
+// (its generic CPU, as for object files) before the module is written, so
+// that llc gets them as they are. The math routines are intrinsics or
+// readnone libm calls (emitPureBuiltin), which the vector library maps to
+// its routines of 2, 4 or 8 doubles. Sums of reals stay in order, the
+// vectorizer does not reassociate them. The passes assume a valid module,
+// one the code generator got wrong is reported instead.
+static void vectorize(Module &M) {
+  std::string problems;
+  raw_string_ostream problemStream(problems);
+  if (verifyModule(M, &problemStream)) {
+    diag() << "Invalid code generated, not vectorized:\n" << problemStream.str();
+    compile_error();
+  }
+  TargetLibraryInfoImpl::VectorLibrary lib;
+  if (!vector_library(opts.vecLib, lib)) {
+    diag() << "Unknown vector library " << opts.vecLib << std::endl;
+    compile_error();
+  }
+  std::unique_ptr<TargetMachine> machine = native_machine(M);
+  if (!machine) compile_error();
+  TargetLibraryInfoImpl libraryInfo(Triple(M.getTargetTriple()));
+  libraryInfo.addVectorizableFunctionsFromVecLib(lib);
+
+  legacy::FunctionPassManager FPM(&M);
+  FPM.add(new TargetLibraryInfoWrapperPass(libraryInfo));
+  FPM.add(createTargetTransformInfoWrapperPass(machine->getTargetIRAnalysis()));
+  FPM.add(createPromoteMemoryToRegisterPass());
+  FPM.add(createInstructionCombiningPass());
+  FPM.add(createCFGSimplificationPass());
+  FPM.add(createLoopRotatePass());
+  FPM.add(createLICMPass());
+  FPM.add(createIndVarSimplifyPass());
+  FPM.add(createLoopVectorizePass());
+  FPM.add(createInstructionCombiningPass());
+  FPM.add(createCFGSimplificationPass());
+  FPM.doInitialization();
+  for (Function &F : M) {
+    if (!F.isDeclaration()) FPM.run(F);
+  }
+  FPM.doFinalization();
+}
+
+// Prints or emits TheModule, throws CompileError.
+static bool emit_module(raw_pwrite_stream &out, Emit emit) {
+  if (!opts.vecLib.empty()) vectorize(*AST::TheModule);
+  if (emit == EMIT_OBJECT) {
+    AST::llvm_dump(nulls());
+    return emit_object(*AST::TheModule, out);
+  }
+  if (emit == EMIT_BITCODE) {
+    AST::llvm_dump(nulls());
+    write_bitcode(*AST::TheModule, out);
+    return true;
+  }
+  AST::llvm_dump(out);
+  return true;
+}
+
+// Checks a parsed program and writes it out, throws CompileError.
+// Opens the scopes of a program; its locals may be checked from then on.
+static void open_program() {
+  // Nothing of the previous program may leak into this one.
+  st = SymbolTable();
+  // The library routines live here, declared as the program names them.
+  st.openScope();
+  st.openScope();
+}
+
+// Checks and emits a program, opened already when open is set.
+static bool check_and_emit(Body *program, raw_pwrite_stream &out, Emit emit,
+                           const std::string &cachePath = "", bool open = false) {
+  if (!open) open_program();
+  program->semOpened();
+  st.closeScope();
+
+  // Routines nothing reaches are not generated at all.
+  st.markReachable();
+  st.inferEffects();
+  // Nested routines take the variables they reach as extra parameters.
+  st.closeCaptures();
+  if (opts.reportDead) {
+    for (SymbolEntry *e : st.routines) {
+      if (!e->reachable) errs() << "pcl: " << e->s << " is never called, not compiled\n";
+    }
+  }
+  st.placeAllocations();
+  if (opts.reportEscape) {
+    for (const SymbolTable::Allocation &a : st.allocations) {
+      if (!a.onStack) continue;
+      errs() << "pcl: " << (a.routine ? a.routine->s : std::string("main program")) << ": new ";
+      if (a.brackets) errs() << "[" << a.count << "] ";
+      errs() << a.var->s << " is on the stack\n";
+    }
+  }
+
+  // Code generation works off the bindings sem left on the tree.
+  TheSSA.clear();
+  TheChecks.clear();
+  TheStrings.clear();
+  program->llvm_compile();
+  if (!cachePath.empty()) cache_store(cachePath, *AST::TheModule);
+  return emit_module(out, emit);
+}
+
+// Compiles the program read from in, or source when in is null.
+static bool compile_source(FILE *in, const std::string &source, raw_pwrite_stream &out,
+                           Emit emit, int *errorLine) {
+  std::string cachePath;
+  if (!opts.cacheDir.empty()) {
+    // The whole source is the key.
+    cachePath = cache_path(source);
+    // The reports come from checking, so they need a real compile.
+    if (!cachePath.empty() && !opts.reportDead && !opts.reportEscape && cache_load(cachePath)) {
+      try {
+        return emit_module(out, emit);
+      }
+      catch (CompileError &e) {
+        if (errorLine) *errorLine = e.line;
+        return false;
+      }
+      catch (std::exception &e) {
+        diag() << "pcl: " << e.what() << std::endl;
+        return false;
+      }
+    }
+  }
+
+  // The tree and the types of this compile go with it.
+  AstArena arena;
+  AstArena::Use use(&arena);
+  ParseContext context;
+  yyscan_t scanner;
+  yylex_init_extra(&context, &scanner);
+  YY_BUFFER_STATE buffer = nullptr;
+  if (in) yyset_in(in, scanner);
+  else buffer = yy_scan_bytes(source.data(), source.size(), scanner);
+  bool ok = true;
+  try {
+    if (yyparse(scanner) != 0 || !context.program) {
+      diag() << "Parsing failed" << std::endl;
+      compile_error();
+    }
+    ok = check_and_emit(context.program, out, emit, cachePath);
+  }
+  catch (CompileError &e) {
+    ok = false;
+    if (errorLine) *errorLine = e.line;
+  }
+  catch (std::exception &e) {
+    diag() << "pcl: " << e.what() << std::endl;
+    ok = false;
+  }
+  if (buffer) yy_delete_buffer(buffer, scanner);
+  yylex_destroy(scanner);
+  return ok;
+}
+
+bool compile_program(FILE *in, raw_pwrite_stream &out,
+                     std::ostream &diagnostics, Emit emit, int *errorLine) {
+  DiagnosticsScope scope(diagnostics);
+  if (opts.cacheDir.empty()) return compile_source(in, std::string(), out, emit, errorLine);
+  std::string source;
+  char chunk[65536];
+  size_t n;
+  while ((n = fread(chunk, 1, sizeof chunk, in)) > 0) source.append(chunk, n);
+  return compile_source(nullptr, source, out, emit, errorLine);
+}
+
+bool compile_program(const std::string &source, raw_pwrite_stream &out,
+                     std::ostream &diagnostics, Emit emit, int *errorLine) {
+  DiagnosticsScope scope(diagnostics);
+  return compile_source(nullptr, source, out, emit, errorLine);
+}
+
+struct StreamCompiler::State {
+  std::ostream &diagnostics;
+  AstArena arena;
+  ParseContext context;
+  yyscan_t scanner;
+  yypstate *parser;
+  std::string pending; // the unfinished last line
+  int line = 1;
+  bool failed = false;
+  int errorLine = 0;
+
+  State(std::ostream &d) : diagnostics(d) {}
+  void push(const char *text, size_t size);
+};
+
+// Scans a piece that ends between two tokens and pushes its tokens to the
+// parser, throws CompileError. Only comments span lines and the scanner
+// keeps its start condition from one piece to the next.
+void StreamCompiler::State::push(const char *text, size_t size) {
+  YY_BUFFER_STATE buffer = yy_scan_bytes(text, size, scanner);
+  // Every buffer counts lines from 1.
+  yyset_lineno(line, scanner);
+  try {
+    for (;;) {
+      YYSTYPE value;
+      int token = yylex(&value, scanner);
+      if (token == 0) break; // the end of this piece, not of the program
+      if (yypush_parse(parser, token, &value, scanner) != YYPUSH_MORE)
+        compile_error(yyget_lineno(scanner));
+    }
+  }
+  catch (...) {
+    yy_delete_buffer(buffer, scanner);
+    throw;
+  }
+  line = yyget_lineno(scanner);
+  yy_delete_buffer(buffer, scanner);
+}
+
+StreamCompiler::StreamCompiler(std::ostream &diagnostics)
+    : state(new State(diagnostics)) {
+  open_program();
+  // Within feed or finish, so diagnostics and nodes go where they belong.
+  state->context.onLocal = [](Local *local) { local->sem(); };
+  yylex_init_extra(&state->context, &state->scanner);
+  state->parser = yypstate_new();
+}
+
+StreamCompiler::~StreamCompiler() {
+  yypstate_delete(state->parser);
+  yylex_destroy(state->scanner);
+  delete state;
+}
+
+bool StreamCompiler::feed(const char *data, size_t size) {
+  if (state->failed) return false;
+  state->pending.append(data, size);
+  size_t nl = state->pending.rfind('\n');
+  if (nl == std::string::npos) return true;
+  DiagnosticsScope scope(state->diagnostics);
+  AstArena::Use use(&state->arena);
+  try {
+    state->push(state->pending.data(), nl + 1);
+  }
+  catch (CompileError &e) {
+    state->failed = true;
+    state->errorLine = e.line;
+  }
+  catch (std::exception &e) {
+    diag() << "pcl: " << e.what() << std::endl;
+    state->failed = true;
+  }
+  state->pending.erase(0, nl + 1);
+  return !state->failed;
+}
+
+bool StreamCompiler::finish(raw_pwrite_stream &out, Emit emit, int *errorLine) {
+  DiagnosticsScope scope(state->diagnostics);
+  AstArena::Use use(&state->arena);
+  bool ok = !state->failed;
+  if (ok) {
+    try {
+      if (!state->pending.empty())
+        state->push(state->pending.data(), state->pending.size());
+      state->pending.clear();
+      if (yypush_parse(state->parser, 0, nullptr, state->scanner) != 0 ||
+          !state->context.program) {
+        diag() << "Parsing failed" << std::endl;
+        compile_error();
+      }
+      ok = check_and_emit(state->context.program, out, emit, "", true);
+    }
+    catch (CompileError &e) {
+      ok = false;
+      state->failed = true;
+      state->errorLine = e.line;
+    }
+    catch (std::exception &e) {
+      diag() << "pcl: " << e.what() << std::endl;
+      ok = false;
+      state->failed = true;
+    }
+  }
+  if (!ok && errorLine) *errorLine = state->errorLine;
+  return ok;
+}
@@ -0,0 +1,58 @@
+#ifndef __DRIVER_HPP__
+#define __DRIVER_HPP__
+#include <cstdio>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <llvm/Support/raw_ostream.h>
+
+enum Emit { EMIT_IR, EMIT_OBJECT, EMIT_BITCODE };
+
+// Parses, checks and compiles one program read from in. The textual IR, a
+// native object file or bitcode is written to out and error messages to
+// diagnostics. Returns false if the program is wrong, errorLine then gets
+// the line of the error (0 when it has none). The compiler is
+// ready for the next program either way. Threads may compile concurrently,
+// each one has a compiler (symbol table, LLVM context, scanner, options) of
+// its own.
+bool compile_program(FILE *in, llvm::raw_pwrite_stream &out,
+                     std::ostream &diagnostics, Emit emit = EMIT_IR,
+                     int *errorLine = nullptr);
+// The same, for a program already in memory.
+bool compile_program(const std::string &source, llvm::raw_pwrite_stream &out,
+                     std::ostream &diagnostics, Emit emit = EMIT_IR,
+                     int *errorLine = nullptr);
+
+// Compiles a program that arrives in pieces, from a pipe or a socket say.
+// Every complete line fed is parsed right away and so is every var, label
+// and routine of the program checked, so both overlap the I/O; finish()
+// parses the rest, checks the main block and emits the program. The
+// calling thread's compiler belongs to it until then.
+class StreamCompiler {
+public:
+  explicit StreamCompiler(std::ostream &diagnostics);
+  ~StreamCompiler();
+  StreamCompiler(const StreamCompiler &) = delete;
+  StreamCompiler &operator=(const StreamCompiler &) = delete;
+  // False once the program is known to be wrong, later pieces are ignored.
+  bool feed(const char *data, size_t size);
+  // Same as compile_program from here on.
+  bool finish(llvm::raw_pwrite_stream &out, Emit emit = EMIT_IR,
+              int *errorLine = nullptr);
+
+private:
+  struct State;
+  State *state;
+};
+
+// pcl --server: answers compile requests on a unix socket until killed.
+int run_server(const char *path);
+
+// pcl -j N a.pcl b.pcl ...: compiles every file to its .ll on N threads.
+int run_batch(unsigned jobs, const std::vector<std::string> &files);
+
+// pcl --lsp: a language server for editors on stdin and stdout.
+int run_lsp();
+
+#endif
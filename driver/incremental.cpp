@@ -0,0 +1,388 @@
+#include "incremental.hpp"
+#include "../semantic/ast.hpp"
+#include "../parser/parser.hpp"
+
+#include <cctype>
+#include <sstream>
+
+namespace pcl {
+
+static const std::set<std::string> keywords = {
+  "and", "array", "begin", "boolean", "char", "dispose", "div", "do", "else",
+  "end", "false", "forward", "function", "goto", "if", "integer", "label",
+  "mod", "new", "nil", "not", "of", "or", "procedure", "program", "real",
+  "result", "return", "then", "true", "var", "while",
+};
+
+namespace {
+
+// A word or a punctuation character of the text, comments, characters and
+// strings are skipped. Enough of the language to find where the top level
+// parts begin and end, the parser sees the parts themselves.
+struct Word {
+  std::string text;
+  size_t begin, end;
+  int line;
+};
+
+std::vector<Word> words(const std::string &text) {
+  std::vector<Word> out;
+  int line = 1;
+  size_t i = 0, n = text.size();
+  while (i < n) {
+    char c = text[i];
+    if (c == '\n') { line++; i++; continue; }
+    if (isspace((unsigned char)c)) { i++; continue; }
+    if (c == '(' && i + 1 < n && text[i + 1] == '*') {
+      for (i += 2; i < n && !(text[i] == '*' && i + 1 < n && text[i + 1] == ')'); i++) {
+        if (text[i] == '\n') line++;
+      }
+      i += 2;
+      continue;
+    }
+    if (c == '"' || c == '\'') {
+      for (i++; i < n && text[i] != c && text[i] != '\n'; i++) {
+        if (text[i] == '\\') i++;
+      }
+      i++;
+      continue;
+    }
+    size_t begin = i;
+    if (isalpha((unsigned char)c)) {
+      while (i < n && (isalnum((unsigned char)text[i]) || text[i] == '_')) i++;
+    } else {
+      i++;
+    }
+    out.push_back(Word{ text.substr(begin, i - begin), begin, i, line });
+  }
+  return out;
+}
+
+bool isName(const std::string &w) {
+  return isalpha((unsigned char)w[0]) && !keywords.count(w);
+}
+
+bool startsLocal(const std::string &w) {
+  return w == "var" || w == "label" || w == "procedure" || w == "function" ||
+         w == "forward";
+}
+
+}
+
+// Cuts the text into its parts, see the class comment. A part that does not
+// end where the language says it should runs up to the next part, the parser
+// reports what is wrong with it.
+static std::vector<IncrementalEngine::Part> split(const std::string &text) {
+  typedef IncrementalEngine::Part Part;
+  std::vector<Word> w = words(text);
+  std::vector<Part> parts;
+  size_t i = 0;
+  auto open = [&](IncrementalEngine::Kind kind) {
+    Part part;
+    part.kind = kind;
+    part.begin = i < w.size() ? w[i].begin : text.size();
+    part.line = i < w.size() ? w[i].line : 1;
+    parts.push_back(part);
+  };
+  auto close = [&]() {
+    Part &part = parts.back();
+    part.end = i < w.size() ? w[i].begin : text.size();
+    if (part.end < part.begin) part.end = part.begin;
+    part.text = text.substr(part.begin, part.end - part.begin);
+  };
+  auto take = [&]() {
+    if (isName(w[i].text)) parts.back().names.insert(w[i].text);
+    i++;
+  };
+
+  // program id ;
+  open(IncrementalEngine::HEADER);
+  while (i < w.size() && w[i].text != ";" && !startsLocal(w[i].text) && w[i].text != "begin") take();
+  if (i < w.size() && w[i].text == ";") take();
+  close();
+
+  while (i < w.size() && w[i].text != "begin") {
+    const std::string first = w[i].text;
+    open(IncrementalEngine::LOCAL);
+    Part &part = parts.back();
+    if (first == "var" || first == "label") {
+      take();
+      while (i < w.size() && !startsLocal(w[i].text) && w[i].text != "begin") take();
+      part.declares = part.names;
+    } else if (first == "forward") {
+      take();
+      int parens = 0;
+      while (i < w.size()) {
+        const std::string &t = w[i].text;
+        if (t == "(") parens++;
+        if (t == ")") parens--;
+        if (part.declares.empty() && isName(t)) part.declares.insert(t);
+        take();
+        if (t == ";" && parens <= 0) break;
+      }
+    } else if (first == "procedure" || first == "function") {
+      // Routines waiting for their body, and begin..end depth.
+      int routines = 0, depth = 0;
+      bool forward = false, done = false;
+      while (i < w.size() && !done) {
+        const std::string t = w[i].text;
+        if (t == "forward") forward = true;
+        else if (t == "procedure" || t == "function") {
+          if (!forward) routines++;
+          forward = false;
+        }
+        else if (t == "begin") depth++;
+        else if (t == "end" && depth > 0 && --depth == 0 && --routines == 0) {
+          take();
+          if (i < w.size() && w[i].text == ";") take();
+          done = true;
+          continue;
+        }
+        if (part.declares.empty() && isName(t)) part.declares.insert(t);
+        take();
+      }
+    } else {
+      // Not a declaration, up to the next one.
+      while (i < w.size() && !startsLocal(w[i].text) && w[i].text != "begin") take();
+    }
+    close();
+  }
+
+  open(IncrementalEngine::BLOCK);
+  int depth = 0;
+  while (i < w.size()) {
+    const std::string t = w[i].text;
+    take();
+    if (t == "begin") depth++;
+    if (t == "end" && --depth <= 0) break;
+  }
+  close();
+
+  open(IncrementalEngine::TAIL);
+  i = w.size();
+  close();
+  return parts;
+}
+
+IncrementalEngine::IncrementalEngine() {}
+
+IncrementalEngine::~IncrementalEngine() {}
+
+static bool sameText(const IncrementalEngine::Part &a, const IncrementalEngine::Part &b) {
+  return a.kind == b.kind && a.text == b.text;
+}
+
+void IncrementalEngine::update(const std::string &newText) {
+  text = newText;
+  std::vector<Part> old;
+  old.swap(parts);
+  parts = split(text);
+  reparsed = rechecked = 0;
+
+  // Parts keep their place, so a greedy match in order finds every part that
+  // is still there, wherever it moved.
+  std::vector<bool> kept(old.size(), false);
+  std::set<std::string> changed;
+  size_t next = 0;
+  for (Part &part : parts) {
+    size_t j = next;
+    while (j < old.size() && !sameText(old[j], part)) j++;
+    if (j < old.size()) {
+      Part &was = old[j];
+      part.local = was.local;
+      part.block = was.block;
+      part.arena = was.arena;
+      part.parseErrors = was.parseErrors;
+      part.checkErrors = was.checkErrors;
+      part.dirty = false;
+      kept[j] = true;
+      next = j + 1;
+      continue;
+    }
+    changed.insert(part.declares.begin(), part.declares.end());
+  }
+  for (size_t j = 0; j < old.size(); j++) {
+    if (!kept[j]) changed.insert(old[j].declares.begin(), old[j].declares.end());
+  }
+  for (Part &part : parts) {
+    for (const std::string &name : part.names) {
+      if (changed.count(name)) part.dirty = true;
+    }
+    // Parsed again rather than checked again, see the class comment.
+    if (part.dirty) parse(part);
+  }
+  // The trees of the parts that are gone or parsed again go with old.
+
+  // The program scope is built again each time from the declarations, only
+  // the dirty parts are checked.
+  st = SymbolTable();
+  hovers.clear();
+  st.openScope();
+  st.openScope();
+  for (Part &part : parts) check(part);
+  st.closeScope();
+  st.closeScope();
+}
+
+void IncrementalEngine::parse(Part &part) {
+  reparsed++;
+  part.parseErrors.clear();
+  part.checkErrors.clear();
+  part.local = nullptr;
+  part.block = nullptr;
+  part.arena.reset();
+  if (part.kind == HEADER) {
+    std::vector<Word> w = words(part.text);
+    if (w.size() != 3 || w[0].text != "program" || !isName(w[1].text) || w[2].text != ";")
+      part.parseErrors.push_back(Diagnostic{ 0, "expected \"program name;\"\n" });
+    return;
+  }
+  if (part.kind == TAIL) {
+    std::vector<Word> w = words(part.text);
+    if (w.size() != 1 || w[0].text != ".")
+      part.parseErrors.push_back(Diagnostic{ 0, "expected \".\" after the main block\n" });
+    return;
+  }
+
+  part.arena = std::make_shared<AstArena>();
+  AstArena::Use use(part.arena.get());
+  std::ostringstream diagnostics;
+  DiagnosticsScope scope(diagnostics);
+  ParseContext context;
+  context.startToken = part.kind == BLOCK ? T_unit_block : T_unit_local;
+  yyscan_t scanner;
+  yylex_init_extra(&context, &scanner);
+  YY_BUFFER_STATE buffer = yy_scan_bytes(part.text.data(), part.text.size(), scanner);
+  yyset_lineno(part.line, scanner);
+  try {
+    if (yyparse(scanner) != 0) {
+      diag() << "Parsing failed\n";
+      compile_error(yyget_lineno(scanner));
+    }
+  } catch (CompileError &e) {
+    int line = e.line ? e.line : part.line;
+    part.parseErrors.push_back(Diagnostic{ line - part.line, diagnostics.str() });
+    context.local = nullptr;
+    context.block = nullptr;
+  }
+  yy_delete_buffer(buffer, scanner);
+  yylex_destroy(scanner);
+  part.local = context.local;
+  part.block = context.block;
+}
+
+static std::string spell(OurType *t) {
+  if (!t) return "?";
+  switch (t->val) {
+  case TYPE_INTEGER: return "integer";
+  case TYPE_BOOLEAN: return "boolean";
+  case TYPE_REAL: return "real";
+  case TYPE_CHAR: return "char";
+  case TYPE_ARRAY:
+    if (t->size > 0) return "array [" + std::to_string(t->size) + "] of " + spell(t->oftype);
+    return "array of " + spell(t->oftype);
+  case TYPE_POINTER: return "^" + spell(t->oftype);
+  default: return "?";
+  }
+}
+
+static std::string spell(const std::string &name, Formal_list *formals) {
+  std::string s = name;
+  if (!formals || formals->getList().empty()) return s;
+  s += "(";
+  bool first = true;
+  for (Formal *f : formals->getList()) {
+    if (!first) s += "; ";
+    first = false;
+    if (f->isReference()) s += "var ";
+    bool firstId = true;
+    for (char *id : f->getIdList()) {
+      if (!firstId) s += ", ";
+      firstId = false;
+      s += id;
+    }
+    s += ": " + spell(f->getType());
+  }
+  return s + ")";
+}
+
+static std::string spell(const Builtin &b) {
+  static const char *types[] = { "", "integer", "boolean", "char", "real", "array of char" };
+  std::string s = b.result == B_VOID ? "procedure " : "function ";
+  s += b.name;
+  if (b.arity) {
+    s += "(";
+    for (unsigned i = 0; i < b.arity; i++) {
+      if (i) s += "; ";
+      if (b.params[i].byRef) s += "var ";
+      s += std::string(b.params[i].name) + ": " + types[b.params[i].type];
+    }
+    s += ")";
+  }
+  if (b.result != B_VOID) s += std::string(": ") + types[b.result];
+  return s;
+}
+
+void IncrementalEngine::check(Part &part) {
+  if (part.dirty) part.checkErrors.clear();
+  if (part.local || (part.block && part.dirty)) {
+    if (part.dirty) rechecked++;
+    AstArena::Use use(part.arena.get());
+    std::ostringstream diagnostics;
+    DiagnosticsScope scope(diagnostics);
+    int depth = st.getSize();
+    try {
+      if (part.block) part.block->sem();
+      else if (part.dirty) part.local->sem();
+      else part.local->declare();
+    } catch (CompileError &e) {
+      while (st.getSize() > depth) st.closeScope();
+      if (part.dirty) {
+        int line = e.line ? e.line : part.line;
+        part.checkErrors.push_back(Diagnostic{ line - part.line, diagnostics.str() });
+      }
+    }
+  }
+  part.dirty = false;
+
+  for (const std::string &name : part.declares) {
+    SymbolEntry *e = st.getSymbolEntry(name);
+    if (!e) continue;
+    std::string &h = hovers[name];
+    if (st.isProcedure(name)) h = "procedure " + spell(name, st.getFormalsProcedure(name));
+    else if (st.isFunction(name))
+      h = "function " + spell(name, st.getFormalsFunction(name)) + ": " + spell(e->type);
+    else if (e->type && e->type->val == TYPE_LABEL) h = "label " + name;
+    else h = "var " + name + ": " + spell(e->type);
+  }
+}
+
+std::vector<Diagnostic> IncrementalEngine::diagnostics() const {
+  std::vector<Diagnostic> out;
+  for (const Part &part : parts) {
+    for (const Diagnostic &d : part.parseErrors)
+      out.push_back(Diagnostic{ part.line + d.line, d.message });
+    for (const Diagnostic &d : part.checkErrors)
+      out.push_back(Diagnostic{ part.line + d.line, d.message });
+  }
+  return out;
+}
+
+std::string IncrementalEngine::hover(int line, int column) const {
+  size_t at = 0;
+  for (int l = 0; l < line && at < text.size(); at++) {
+    if (text[at] == '\n') l++;
+  }
+  at += column;
+  if (at >= text.size() || !(isalnum((unsigned char)text[at]) || text[at] == '_')) return "";
+  size_t begin = at, end = at;
+  while (begin > 0 && (isalnum((unsigned char)text[begin - 1]) || text[begin - 1] == '_')) begin--;
+  while (end < text.size() && (isalnum((unsigned char)text[end]) || text[end] == '_')) end++;
+  std::string name = text.substr(begin, end - begin);
+  std::map<std::string, std::string>::const_iterator h = hovers.find(name);
+  if (h != hovers.end()) return h->second;
+  if (const Builtin *b = findBuiltin(name.c_str())) return spell(*b);
+  return "";
+}
+
+}
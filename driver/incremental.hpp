@@ -0,0 +1,71 @@
+#ifndef __INCREMENTAL_HPP__
+#define __INCREMENTAL_HPP__
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+#include "pcl.hpp"
+
+class AstArena;
+class Local;
+class Block;
+
+namespace pcl {
+
+// Keeps one edited program checked. The text is cut into its top level
+// parts: the program header, each var, label, forward, procedure and
+// function declaration, and the main block. update() parses and checks
+// again only the parts whose text changed and the parts that name something
+// a changed part declares; everything else keeps its tree and its
+// diagnostics from the previous update. A tree is checked once: sem
+// rewrites it as it goes.
+class IncrementalEngine {
+public:
+  IncrementalEngine();
+  ~IncrementalEngine();
+  IncrementalEngine(const IncrementalEngine &) = delete;
+  IncrementalEngine &operator=(const IncrementalEngine &) = delete;
+
+  void update(const std::string &text);
+  // Lines are 1-based, as in the compiler's own messages.
+  std::vector<Diagnostic> diagnostics() const;
+  // What the name under the cursor is, for names declared at the top level
+  // of the program and for the library routines; empty when nothing is known.
+  // Line and column are 0-based.
+  std::string hover(int line, int column) const;
+
+  // Parts parsed and checked by the last update.
+  unsigned reparsed = 0;
+  unsigned rechecked = 0;
+
+  enum Kind { HEADER, LOCAL, BLOCK, TAIL };
+  struct Part {
+    Kind kind;
+    size_t begin, end;         // offsets into the text
+    int line;                  // of begin
+    std::string text;
+    std::set<std::string> names;    // identifiers it mentions
+    std::set<std::string> declares; // top level names it declares
+    Local *local = nullptr;
+    Block *block = nullptr;
+    // Owns the tree and what checking it allocated, shared by the copies of
+    // the part from one update to the next.
+    std::shared_ptr<AstArena> arena;
+    // Relative to line, so that they survive edits above the part.
+    std::vector<Diagnostic> parseErrors, checkErrors;
+    bool dirty = true;
+  };
+
+private:
+  void parse(Part &part);
+  void check(Part &part);
+
+  std::string text;
+  std::vector<Part> parts;
+  std::map<std::string, std::string> hovers;
+};
+
+}
+
+#endif
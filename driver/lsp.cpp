@@ -0,0 +1,412 @@
+#include "driver.hpp"
+#include "incremental.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// A language server on stdin and stdout: diagnostics while the program is
+// edited and hovers over its declarations. Each open document has an
+// IncrementalEngine, so a keystroke costs the parts it touched.
+
+namespace {
+
+// As much JSON as the protocol needs.
+struct Json {
+  enum Kind { NUL, BOOL, NUMBER, STRING, ARRAY, OBJECT } kind = NUL;
+  bool boolean = false;
+  double number = 0;
+  std::string string;
+  std::vector<Json> array;
+  std::map<std::string, Json> object;
+
+  Json() {}
+  Json(bool b) : kind(BOOL), boolean(b) {}
+  Json(int n) : kind(NUMBER), number(n) {}
+  Json(const char *s) : kind(STRING), string(s) {}
+  Json(const std::string &s) : kind(STRING), string(s) {}
+  static Json makeObject() { Json j; j.kind = OBJECT; return j; }
+  static Json makeArray() { Json j; j.kind = ARRAY; return j; }
+
+  const Json &operator[](const char *key) const {
+    static const Json none;
+    std::map<std::string, Json>::const_iterator it = object.find(key);
+    return it == object.end() ? none : it->second;
+  }
+  Json &set(const char *key, const Json &value) {
+    kind = OBJECT;
+    object[key] = value;
+    return *this;
+  }
+  int asInt() const { return (int)number; }
+  bool has(const char *key) const { return object.count(key) != 0; }
+};
+
+struct JsonReader {
+  const std::string &s;
+  size_t i = 0;
+  explicit JsonReader(const std::string &text) : s(text) {}
+
+  void skip() {
+    while (i < s.size() && isspace((unsigned char)s[i])) i++;
+  }
+  bool value(Json &out) {
+    skip();
+    if (i >= s.size()) return false;
+    char c = s[i];
+    if (c == '{') {
+      out = Json::makeObject();
+      i++;
+      skip();
+      if (i < s.size() && s[i] == '}') { i++; return true; }
+      for (;;) {
+        Json key, v;
+        skip();
+        if (!string(key) ) return false;
+        skip();
+        if (i >= s.size() || s[i++] != ':') return false;
+        if (!value(v)) return false;
+        out.object[key.string] = v;
+        skip();
+        if (i < s.size() && s[i] == ',') { i++; continue; }
+        if (i < s.size() && s[i] == '}') { i++; return true; }
+        return false;
+      }
+    }
+    if (c == '[') {
+      out = Json::makeArray();
+      i++;
+      skip();
+      if (i < s.size() && s[i] == ']') { i++; return true; }
+      for (;;) {
+        Json v;
+        if (!value(v)) return false;
+        out.array.push_back(v);
+        skip();
+        if (i < s.size() && s[i] == ',') { i++; continue; }
+        if (i < s.size() && s[i] == ']') { i++; return true; }
+        return false;
+      }
+    }
+    if (c == '"') return string(out);
+    if (s.compare(i, 4, "true") == 0) { out = Json(true); i += 4; return true; }
+    if (s.compare(i, 5, "false") == 0) { out = Json(false); i += 5; return true; }
+    if (s.compare(i, 4, "null") == 0) { out = Json(); i += 4; return true; }
+    char *end;
+    double n = strtod(s.c_str() + i, &end);
+    if (end == s.c_str() + i) return false;
+    i = end - s.c_str();
+    out = Json();
+    out.kind = Json::NUMBER;
+    out.number = n;
+    return true;
+  }
+  bool string(Json &out) {
+    if (i >= s.size() || s[i] != '"') return false;
+    out = Json("");
+    for (i++; i < s.size() && s[i] != '"'; i++) {
+      if (s[i] != '\\') { out.string += s[i]; continue; }
+      if (++i >= s.size()) return false;
+      switch (s[i]) {
+      case 'n': out.string += '\n'; break;
+      case 't': out.string += '\t'; break;
+      case 'r': out.string += '\r'; break;
+      case 'b': out.string += '\b'; break;
+      case 'f': out.string += '\f'; break;
+      case 'u': {
+        unsigned code = strtoul(s.substr(i + 1, 4).c_str(), nullptr, 16);
+        i += 4;
+        // UTF-8, a surrogate pair is one character of four bytes, as the
+        // client has it (see offset).
+        if (code >= 0xD800 && code < 0xDC00 && s.compare(i + 1, 2, "\\u") == 0) {
+          unsigned low = strtoul(s.substr(i + 3, 4).c_str(), nullptr, 16);
+          if (low >= 0xDC00 && low < 0xE000) {
+            code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+            i += 6;
+          }
+        }
+        if (code < 0x80) out.string += (char)code;
+        else if (code < 0x800) {
+          out.string += (char)(0xC0 | (code >> 6));
+          out.string += (char)(0x80 | (code & 0x3F));
+        } else if (code < 0x10000) {
+          out.string += (char)(0xE0 | (code >> 12));
+          out.string += (char)(0x80 | ((code >> 6) & 0x3F));
+          out.string += (char)(0x80 | (code & 0x3F));
+        } else {
+          out.string += (char)(0xF0 | (code >> 18));
+          out.string += (char)(0x80 | ((code >> 12) & 0x3F));
+          out.string += (char)(0x80 | ((code >> 6) & 0x3F));
+          out.string += (char)(0x80 | (code & 0x3F));
+        }
+        break;
+      }
+      default: out.string += s[i];
+      }
+    }
+    if (i >= s.size()) return false;
+    i++;
+    return true;
+  }
+};
+
+void write(std::ostream &out, const Json &j) {
+  switch (j.kind) {
+  case Json::NUL: out << "null"; break;
+  case Json::BOOL: out << (j.boolean ? "true" : "false"); break;
+  case Json::NUMBER: out << j.number; break;
+  case Json::STRING:
+    out << '"';
+    for (char c : j.string) {
+      switch (c) {
+      case '"': out << "\\\""; break;
+      case '\\': out << "\\\\"; break;
+      case '\n': out << "\\n"; break;
+      case '\r': out << "\\r"; break;
+      case '\t': out << "\\t"; break;
+      default:
+        if ((unsigned char)c < 0x20) {
+          char buf[8];
+          snprintf(buf, sizeof buf, "\\u%04x", c);
+          out << buf;
+        } else {
+          out << c;
+        }
+      }
+    }
+    out << '"';
+    break;
+  case Json::ARRAY: {
+    out << '[';
+    bool first = true;
+    for (const Json &v : j.array) {
+      if (!first) out << ',';
+      first = false;
+      write(out, v);
+    }
+    out << ']';
+    break;
+  }
+  case Json::OBJECT: {
+    out << '{';
+    bool first = true;
+    for (const std::pair<const std::string, Json> &kv : j.object) {
+      if (!first) out << ',';
+      first = false;
+      write(out, Json(kv.first));
+      out << ':';
+      write(out, kv.second);
+    }
+    out << '}';
+    break;
+  }
+  }
+}
+
+// Messages are framed by a Content-Length header.
+bool receive(Json &message) {
+  size_t length = 0;
+  bool any = false;
+  std::string line;
+  while (std::getline(std::cin, line)) {
+    if (!line.empty() && line.back() == '\r') line.pop_back();
+    if (line.empty()) {
+      if (any) break;
+      continue;
+    }
+    any = true;
+    if (line.compare(0, 15, "Content-Length:") == 0) length = strtoul(line.c_str() + 15, nullptr, 10);
+  }
+  if (!any || !std::cin) return false;
+  std::string body(length, '\0');
+  std::cin.read(&body[0], length);
+  if ((size_t)std::cin.gcount() != length) return false;
+  JsonReader reader(body);
+  if (!reader.value(message)) message = Json();
+  return true;
+}
+
+void send(const Json &message) {
+  std::ostringstream body;
+  write(body, message);
+  std::string text = body.str();
+  std::cout << "Content-Length: " << text.size() << "\r\n\r\n" << text;
+  std::cout.flush();
+}
+
+void respond(const Json &id, const Json &result) {
+  Json message;
+  message.set("jsonrpc", "2.0").set("id", id).set("result", result);
+  send(message);
+}
+
+void fail(const Json &id, int code, const std::string &text) {
+  Json error;
+  error.set("code", code).set("message", text);
+  Json message;
+  message.set("jsonrpc", "2.0").set("id", id).set("error", error);
+  send(message);
+}
+
+struct Document {
+  std::string text;
+  pcl::IncrementalEngine engine;
+};
+
+// How positions count characters, agreed on in initialize: bytes when the
+// client offers utf-8, otherwise the protocol's default UTF-16 code units.
+bool utf8Positions = false;
+
+// The code units the byte b adds to a position: a UTF-8 sequence of four
+// bytes is a surrogate pair in UTF-16, continuation bytes add nothing.
+int units(unsigned char b) {
+  if (utf8Positions) return 1;
+  if ((b & 0xC0) == 0x80) return 0;
+  return b >= 0xF0 ? 2 : 1;
+}
+
+size_t lineStart(const std::string &text, int line) {
+  size_t at = 0;
+  for (int l = 0; l < line && at < text.size(); at++) {
+    if (text[at] == '\n') l++;
+  }
+  return at;
+}
+
+// Byte offset of an LSP position.
+size_t offset(const std::string &text, const Json &position) {
+  int character = position["character"].asInt();
+  size_t at = lineStart(text, position["line"].asInt());
+  for (int c = 0; at < text.size() && text[at] != '\n'; at++) {
+    int u = units(text[at]);
+    if (c >= character && u > 0) break;
+    c += u;
+  }
+  return at;
+}
+
+// Length of a line in the units positions count.
+int width(const std::string &line) {
+  int w = 0;
+  for (char b : line) w += units(b);
+  return w;
+}
+
+void publish(const std::string &uri, Document *document) {
+  Json diagnostics = Json::makeArray();
+  if (document) {
+    std::vector<std::string> lines;
+    std::istringstream in(document->text);
+    for (std::string l; std::getline(in, l);) lines.push_back(l);
+    for (const pcl::Diagnostic &d : document->engine.diagnostics()) {
+      int line = d.line > 0 ? d.line - 1 : 0;
+      int last = line < (int)lines.size() ? width(lines[line]) : 0;
+      Json start, end, range, diagnostic;
+      start.set("line", line).set("character", 0);
+      end.set("line", line).set("character", last);
+      range.set("start", start).set("end", end);
+      std::string message = d.message;
+      while (!message.empty() && message.back() == '\n') message.pop_back();
+      diagnostic.set("range", range).set("severity", 1).set("source", "pcl").set("message", message);
+      diagnostics.array.push_back(diagnostic);
+    }
+  }
+  Json params, message;
+  params.set("uri", uri).set("diagnostics", diagnostics);
+  message.set("jsonrpc", "2.0").set("method", "textDocument/publishDiagnostics").set("params", params);
+  send(message);
+}
+
+void analyse(const std::string &uri, Document &document) {
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  document.engine.update(document.text);
+  double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  std::cerr << "pcl: " << uri << ": " << document.engine.reparsed << " parts parsed, "
+            << document.engine.rechecked << " checked in " << ms << " ms" << std::endl;
+  publish(uri, &document);
+}
+
+}
+
+int run_lsp() {
+  std::map<std::string, std::unique_ptr<Document>> documents;
+  bool shutdown = false;
+  Json message;
+  while (receive(message)) {
+    const std::string &method = message["method"].string;
+    const Json &params = message["params"];
+    const Json &id = message["id"];
+    bool request = message.has("id");
+
+    if (method == "initialize") {
+      utf8Positions = false;
+      for (const Json &encoding : params["capabilities"]["general"]["positionEncodings"].array) {
+        if (encoding.string == "utf-8") utf8Positions = true;
+      }
+      Json capabilities, info, result;
+      capabilities.set("positionEncoding", utf8Positions ? "utf-8" : "utf-16");
+      capabilities.set("textDocumentSync", 2).set("hoverProvider", true);
+      info.set("name", "pcl");
+      result.set("capabilities", capabilities).set("serverInfo", info);
+      respond(id, result);
+    } else if (method == "shutdown") {
+      shutdown = true;
+      respond(id, Json());
+    } else if (method == "exit") {
+      return shutdown ? 0 : 1;
+    } else if (method == "textDocument/didOpen") {
+      const Json &doc = params["textDocument"];
+      std::unique_ptr<Document> &document = documents[doc["uri"].string];
+      document.reset(new Document);
+      document->text = doc["text"].string;
+      analyse(doc["uri"].string, *document);
+    } else if (method == "textDocument/didChange") {
+      const std::string &uri = params["textDocument"]["uri"].string;
+      std::map<std::string, std::unique_ptr<Document>>::iterator it = documents.find(uri);
+      if (it == documents.end()) continue;
+      Document &document = *it->second;
+      for (const Json &change : params["contentChanges"].array) {
+        if (!change.has("range")) {
+          document.text = change["text"].string;
+          continue;
+        }
+        size_t begin = offset(document.text, change["range"]["start"]);
+        size_t end = offset(document.text, change["range"]["end"]);
+        if (end < begin) end = begin;
+        document.text.replace(begin, end - begin, change["text"].string);
+      }
+      analyse(uri, document);
+    } else if (method == "textDocument/didClose") {
+      const std::string &uri = params["textDocument"]["uri"].string;
+      documents.erase(uri);
+      publish(uri, nullptr);
+    } else if (method == "textDocument/hover") {
+      std::map<std::string, std::unique_ptr<Document>>::iterator it =
+          documents.find(params["textDocument"]["uri"].string);
+      std::string text;
+      if (it != documents.end()) {
+        const std::string &source = it->second->text;
+        int line = params["position"]["line"].asInt();
+        size_t at = offset(source, params["position"]);
+        text = it->second->engine.hover(line, (int)(at - lineStart(source, line)));
+      }
+      if (text.empty()) {
+        respond(id, Json());
+      } else {
+        Json contents, result;
+        contents.set("kind", "plaintext").set("value", text);
+        result.set("contents", contents);
+        respond(id, result);
+      }
+    } else if (request) {
+      fail(id, -32601, "method not supported: " + method);
+    }
+  }
+  return shutdown ? 0 : 1;
+}
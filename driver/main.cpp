@@ -0,0 +1,48 @@
+#include "driver.hpp"
+#include "../semantic/options.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <thread>
+
+static void usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [--profile-generate | --profile-use=file] [--profile-procedures] [--profile-sample] [--cache=dir] [--report-dead] [--report-escape] [--check-overflow] [--veclib=SVML|LIBMVEC|MASSV|Accelerate] < program.pcl\n", prog);
+  fprintf(stderr, "       %s [-j N] [options] program.pcl ...   (writes program.ll)\n", prog);
+  fprintf(stderr, "       %s --server[=socket] [options]\n", prog);
+  fprintf(stderr, "       %s --lsp\n", prog);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  const char *server = nullptr;
+  bool lsp = false;
+  unsigned jobs = std::thread::hardware_concurrency();
+  std::vector<std::string> files;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--profile-generate")) opts.profileGenerate = true;
+    else if (!strncmp(argv[i], "--profile-use=", 14)) opts.profileUse = argv[i] + 14;
+    else if (!strcmp(argv[i], "--profile-procedures")) opts.profileProcedures = true;
+    else if (!strcmp(argv[i], "--profile-sample")) opts.profileSample = true;
+    else if (!strcmp(argv[i], "--server")) server = "pcl.sock";
+    else if (!strncmp(argv[i], "--server=", 9)) server = argv[i] + 9;
+    else if (!strcmp(argv[i], "--lsp")) lsp = true;
+    else if (!strcmp(argv[i], "--report-dead")) opts.reportDead = true;
+    else if (!strcmp(argv[i], "--report-escape")) opts.reportEscape = true;
+    else if (!strcmp(argv[i], "--check-overflow")) opts.checkOverflow = true;
+    else if (!strncmp(argv[i], "--cache=", 8)) opts.cacheDir = argv[i] + 8;
+    else if (!strncmp(argv[i], "--veclib=", 9)) opts.vecLib = argv[i] + 9;
+    else if (!strcmp(argv[i], "-j") && i + 1 < argc) jobs = atoi(argv[++i]);
+    else if (!strncmp(argv[i], "-j", 2) && argv[i][2]) jobs = atoi(argv[i] + 2);
+    else if (argv[i][0] == '-') usage(argv[0]);
+    else files.push_back(argv[i]);
+  }
+  if (opts.profileGenerate && !opts.profileUse.empty()) usage(argv[0]);
+
+  if (lsp) return run_lsp();
+  if (server) return run_server(server);
+  if (!files.empty()) return run_batch(jobs, files);
+  bool ok = compile_program(stdin, llvm::outs(), std::cout);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,70 @@
+#include "pcl.hpp"
+#include "driver.hpp"
+#include "../semantic/diagnostics.hpp"
+
+#include <algorithm>
+#include <sstream>
+
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Support/MemoryBuffer.h>
+
+namespace pcl {
+
+// The options are per thread, so they are swapped in only for this compile.
+static bool run(const std::string &source, const Options &options, Emit emit,
+                llvm::SmallVectorImpl<char> &output, Result &result) {
+  Options previous = opts;
+  opts = options;
+  std::ostringstream diagnostics;
+  std::vector<MessageEnd> ends;
+  TheMessageEnds = &ends;
+  llvm::raw_svector_ostream out(output);
+  int line = 0;
+  result.ok = compile_program(source, out, diagnostics, emit, &line);
+  TheMessageEnds = nullptr;
+  opts = previous;
+
+  if (result.ok) return true;
+  // Each message with its own line, what follows the last one has none.
+  std::string text = diagnostics.str();
+  size_t begin = 0;
+  for (const MessageEnd &end : ends) {
+    size_t at = end.offset < 0 ? begin : (size_t)end.offset;
+    if (at > begin) result.diagnostics.push_back(Diagnostic{ end.line, text.substr(begin, at - begin) });
+    begin = std::max(begin, at);
+  }
+  if (begin < text.size() || result.diagnostics.empty())
+    result.diagnostics.push_back(Diagnostic{ ends.empty() ? line : 0, text.substr(begin) });
+  return false;
+}
+
+// The module is built in the compiling thread's own context, it reaches the
+// caller's context as bitcode.
+Result compile(const std::string &source, const Options &options,
+               llvm::LLVMContext &context) {
+  Result result;
+  llvm::SmallString<0> bitcode;
+  if (!run(source, options, EMIT_BITCODE, bitcode, result)) return result;
+  llvm::Expected<std::unique_ptr<llvm::Module>> module = llvm::parseBitcodeFile(
+      llvm::MemoryBufferRef(llvm::StringRef(bitcode.data(), bitcode.size()), "pcl program"),
+      context);
+  if (!module) {
+    result.ok = false;
+    result.diagnostics.push_back(Diagnostic{ 0, llvm::toString(module.takeError()) });
+    return result;
+  }
+  result.module = std::move(*module);
+  return result;
+}
+
+Result compileToObject(const std::string &source, const Options &options) {
+  Result result;
+  llvm::SmallString<0> object;
+  if (run(source, options, EMIT_OBJECT, object, result))
+    result.object.assign(object.data(), object.size());
+  return result;
+}
+
+}
@@ -0,0 +1,38 @@
+#ifndef __PCL_HPP__
+#define __PCL_HPP__
+#include <memory>
+#include <string>
+#include <vector>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include "../semantic/options.hpp"
+
+// libpcl: the compiler as a library. Programs are compiled from memory,
+// nothing is read from stdin or written to stdout and a wrong program is
+// reported in the result instead of ending the process. Any number of
+// threads may compile at once.
+namespace pcl {
+
+struct Diagnostic {
+  int line;            // of the error, 0 when not known
+  std::string message;
+};
+
+struct Result {
+  bool ok = false;
+  std::vector<Diagnostic> diagnostics;
+  std::unique_ptr<llvm::Module> module; // compile()
+  std::string object;                   // compileToObject()
+};
+
+// Compiles source into a Module owned by the caller and living in context,
+// ready for the caller's passes, linker or JIT.
+Result compile(const std::string &source, const Options &options,
+               llvm::LLVMContext &context);
+
+// Compiles source into a native object file for the host.
+Result compileToObject(const std::string &source, const Options &options);
+
+}
+
+#endif
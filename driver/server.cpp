@@ -0,0 +1,102 @@
+#include "driver.hpp"
+
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <llvm/ADT/SmallVector.h>
+
+// Protocol: the client sends "ir\n" or "obj\n" followed by the program and
+// shuts down its side of the connection. The server answers with
+// "ok <size>\n" and the IR or object file, or "error <size>\n" and the
+// error messages, then closes the connection.
+
+static bool write_all(int fd, const char *data, size_t size) {
+  while (size > 0) {
+    ssize_t n = write(fd, data, size);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+// The program is parsed while it is still arriving.
+static void serve(int client) {
+  std::ostringstream diagnostics;
+  StreamCompiler compiler(diagnostics);
+  std::string mode;
+  bool haveMode = false;
+  char buffer[65536];
+  for (;;) {
+    ssize_t n = read(client, buffer, sizeof(buffer));
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) return;
+    if (n == 0) break;
+    const char *data = buffer;
+    size_t size = n;
+    if (!haveMode) {
+      const char *nl = (const char *) memchr(data, '\n', size);
+      mode.append(data, nl ? nl - data : size);
+      if (!nl) continue;
+      haveMode = true;
+      size -= nl + 1 - data;
+      data = nl + 1;
+    }
+    // A wrong program is still read to its end before the answer.
+    if (mode == "ir" || mode == "obj") compiler.feed(data, size);
+  }
+
+  llvm::SmallVector<char, 0> result;
+  llvm::raw_svector_ostream out(result);
+  bool ok = false;
+  if (mode != "ir" && mode != "obj") {
+    diagnostics << "Unknown request " << mode << ", expected ir or obj" << std::endl;
+  }
+  else {
+    ok = compiler.finish(out, mode == "obj" ? EMIT_OBJECT : EMIT_IR);
+  }
+
+  std::string payload = ok ? std::string(result.begin(), result.end()) : diagnostics.str();
+  std::string header = (ok ? "ok " : "error ") + std::to_string(payload.size()) + "\n";
+  if (write_all(client, header.data(), header.size()))
+    write_all(client, payload.data(), payload.size());
+}
+
+int run_server(const char *path) {
+  signal(SIGPIPE, SIG_IGN);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    perror("socket");
+    return 1;
+  }
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path %s is too long\n", path);
+    return 1;
+  }
+  strcpy(addr.sun_path, path);
+  unlink(path);
+  if (bind(fd, (sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 64) < 0) {
+    perror(path);
+    return 1;
+  }
+  for (;;) {
+    int client = accept(fd, nullptr, nullptr);
+    if (client < 0) {
+      if (errno == EINTR) continue;
+      perror("accept");
+      return 1;
+    }
+    serve(client);
+    close(client);
+  }
+}
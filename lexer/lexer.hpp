@@ -1,8 +1,46 @@
 #ifndef __LEXER_HPP__
 #define __LEXER_HPP__
+#include <cstdio>
+#include <functional>
 #include <vector>
 
-int yylex();
-void yyerror(const char *msg);
+#ifndef YY_TYPEDEF_YY_SCANNER_T
+#define YY_TYPEDEF_YY_SCANNER_T
+typedef void *yyscan_t;
+#endif
+
+#ifndef YY_TYPEDEF_YY_BUFFER_STATE
+#define YY_TYPEDEF_YY_BUFFER_STATE
+typedef struct yy_buffer_state *YY_BUFFER_STATE;
+#endif
+
+class Body;
+class Local;
+class Block;
+
+// What a parse produces besides the tokens, kept as the scanner's extra
+// data so that every scanner/parser pair is independent of the others.
+struct ParseContext {
+  Body *program = nullptr;  // set when the whole program is reduced
+  // Called for every var, label, forward and routine of the program itself,
+  // not of its routines, as soon as it is parsed.
+  std::function<void(Local *)> onLocal;
+  int routines = 0; // whose headers are parsed and bodies are not
+  // T_unit_local or T_unit_block to parse one local or the main block
+  // alone, the result is then left in local or block.
+  int startToken = 0;
+  Local *local = nullptr;
+  Block *block = nullptr;
+};
+
+int yylex_init_extra(ParseContext *extra, yyscan_t *scanner);
+int yylex_destroy(yyscan_t scanner);
+void yyset_in(FILE *in, yyscan_t scanner);
+YY_BUFFER_STATE yy_scan_bytes(const char *bytes, int len, yyscan_t scanner);
+void yy_delete_buffer(YY_BUFFER_STATE buffer, yyscan_t scanner);
+void yyset_lineno(int line, yyscan_t scanner);
+ParseContext *yyget_extra(yyscan_t scanner);
+int yyget_lineno(yyscan_t scanner);
+void yyerror(yyscan_t scanner, const char *msg);
 
 #endif
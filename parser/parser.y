@@ -4,30 +4,58 @@
   #include "../semantic/ast.hpp"
   #include "../lexer/lexer.hpp"
 
-  SymbolTable st;
-  std::vector<int> rt_stack;
+  thread_local SymbolTable st;
+  thread_local SSABuilder TheSSA;
+  thread_local OverflowChecks TheChecks;
+  thread_local StringPool TheStrings;
+  thread_local Options opts;
+  thread_local std::ostream *TheDiagnostics = &std::cout;
+  thread_local int TheCheckedLine = 0;
+  thread_local std::vector<MessageEnd> *TheMessageEnds = nullptr;
+  thread_local std::vector<int> rt_stack;
+  thread_local AstArena *AstArena::current = nullptr;
   #define DEBUGPARSER false
 
-  LLVMContext AST::TheContext;
-  IRBuilder<> AST::Builder(TheContext);
-  std::unique_ptr<Module> AST::TheModule;
-  std::unique_ptr<legacy::FunctionPassManager> AST::TheFPM;
+  // Hands a local to ParseContext::onLocal when it is the program's own.
+  static void parsedLocal(yyscan_t scanner, Local *local) {
+    ParseContext *context = yyget_extra(scanner);
+    if(context->routines == 0 && context->onLocal) context->onLocal(local);
+  }
+
+  // Of a statement that starts with e: e's own, or where the parser is.
+  static int lineOf(Expr *e, yyscan_t scanner) {
+    return e->line ? e->line : yyget_lineno(scanner);
+  }
 
-  GlobalVariable *AST::TheVars;
-  GlobalVariable *AST::TheRealVars;
-  GlobalVariable *AST::TheNL;
-  Function *AST::TheWriteInteger;
-  Function *AST::TheWriteReal;
-  Function *AST::TheWriteString;
+  thread_local LLVMContext AST::TheContext;
+  thread_local IRBuilder<> AST::Builder(TheContext);
+  thread_local std::unique_ptr<Module> AST::TheModule;
+  thread_local std::unique_ptr<legacy::FunctionPassManager> AST::TheFPM;
 
-  Type *AST::i1 = IntegerType::get(TheContext, 1);
-  Type *AST::i8 = IntegerType::get(TheContext, 8);
-  Type *AST::i32 = IntegerType::get(TheContext, 32);
-  Type *AST::i64 = IntegerType::get(TheContext, 64);
-  Type *AST::DoubleTyID = Type::getDoubleTy(TheContext);
+  thread_local GlobalVariable *AST::TheVars;
+  thread_local GlobalVariable *AST::TheRealVars;
+  thread_local GlobalVariable *AST::TheNL;
+
+  thread_local Type *AST::i1 = IntegerType::get(TheContext, 1);
+  thread_local Type *AST::i8 = IntegerType::get(TheContext, 8);
+  thread_local Type *AST::i32 = IntegerType::get(TheContext, 32);
+  thread_local Type *AST::i64 = IntegerType::get(TheContext, 64);
+  thread_local Type *AST::DoubleTyID = Type::getDoubleTy(TheContext);
 
 %}
 
+%code requires {
+  #include "../lexer/lexer.hpp"
+}
+
+%code provides {
+  int yylex(YYSTYPE *yylval_param, yyscan_t yyscanner);
+}
+
+%define api.pure full
+%define api.push-pull both
+%param {yyscan_t scanner}
+
 %define parse.error verbose
 %verbose
 %define parse.trace
@@ -95,6 +123,11 @@
 %token<stri> T_const_string
 %token<ids> T_id
 
+/* Never in the text: the scanner returns one of them first to parse a
+   single part of a program (ParseContext::startToken). */
+%token T_unit_local
+%token T_unit_block
+
 /*operators*/
 %nonassoc<op> "=" ">" "<" ">=" "<=" "<>"
 %left<op> "+" "-" "or"
@@ -156,31 +189,27 @@
 %type<expr_list> expr_list
 %type<call> call
 %type<callr> callr
+%type<num> call_open
 
 
 %type<expr>  expr l-value r-value
 %type<type>  type
 
 
+%start unit
+
 %%
 
+unit:
+  program
+  | T_unit_local local { yyget_extra(scanner)->local = $2; }
+  | T_unit_block block { yyget_extra(scanner)->block = $2; }
+  ;
+
 program:
   "program" T_id ";" body "."{
-    st.openScope();
-    Library *l = new Library();
-    l->init(); // Initialize all built in functions and procedures
     if(DEBUGPARSER) $4->printOn(std::cout);
-
-    $4->sem();
-    st.closeScope();
-    st.openScope();
-
-    $4->llvm_compile_and_dump();
-
-    st.closeScope();
-
-    // std::cout << "AST: " << *$1 << std::endl;
-    //$1->run();
+    yyget_extra(scanner)->program = $4; // compile_program takes it from here
   }
   ;
 
@@ -193,10 +222,14 @@ local_list:
   ;
 
 local:
- "var" decl_list { $$ = new Local($2); }
- | "label" decl_label { $$ = new Local($2); }
- | header ";" body ";" { $$ = new Local($1, $3); }
- | "forward" header ";" { $$ = new Local($2); }
+ "var" decl_list { $$ = new Local($2); parsedLocal(scanner, $$); }
+ | "label" decl_label { $$ = new Local($2); parsedLocal(scanner, $$); }
+ | header ";" body ";" {
+     $$ = new Local($1, $3);
+     yyget_extra(scanner)->routines--;
+     parsedLocal(scanner, $$);
+   }
+ | "forward" header ";" { $$ = new Local($2); yyget_extra(scanner)->routines--; parsedLocal(scanner, $$); }
  ;
 
 decl_label:
@@ -215,13 +248,13 @@ decl_list:
   ;
 
 decl:
-  T_id id_list ":" type ";" { $2->append_begin($1);$$ = new Decl($2, $4);}
+  T_id id_list ":" type ";" { $2->append_begin($1);$$ = new Decl($2, $4); $$->line = yyget_lineno(scanner); }
 
 header:
- "procedure" T_id "(" formal formal_list  ")" { $5->append_begin($4); $$ = new Procedure($2, $5); }
- | "procedure" T_id "(" ")" { $$ = new Procedure($2); }
- | "function" T_id "(" formal formal_list  ")" ":" type { $5->append_begin($4); $$ = new OurFunction($2, $8, $5);}
- | "function" T_id "(" ")" ":" type { $$ = new OurFunction($2, $6);}
+ "procedure" T_id "(" formal formal_list  ")" { $5->append_begin($4); $$ = new Procedure($2, $5); $$->line = yyget_lineno(scanner); yyget_extra(scanner)->routines++; }
+ | "procedure" T_id "(" ")" { $$ = new Procedure($2); $$->line = yyget_lineno(scanner); yyget_extra(scanner)->routines++; }
+ | "function" T_id "(" formal formal_list  ")" ":" type { $5->append_begin($4); $$ = new OurFunction($2, $8, $5); $$->line = yyget_lineno(scanner); yyget_extra(scanner)->routines++; }
+ | "function" T_id "(" ")" ":" type { $$ = new OurFunction($2, $6); $$->line = yyget_lineno(scanner); yyget_extra(scanner)->routines++; }
  ;
 
 formal_list:
@@ -255,19 +288,19 @@ stmt_list:
 
 stmt:
   /*nothing*/ { $$ = nullptr;}
-  | l-value ":=" expr { $$ = new Assign($1, $3); }
+  | l-value ":=" expr { $$ = new Assign($1, $3); $$->line = lineOf($1, scanner); }
   | block { $$ = $1; }
   | call { $$ = $1; }
-  | "if" expr "then" stmt { $$ = new If($2, $4); }
-  | "if" expr "then" stmt "else" stmt { $$ = new If($2, $4, $6); }
-  | "while" expr "do" stmt { $$ = new While($2, $4); }
-  | T_id ":" stmt { $$ = new IdLabel($1, $3); }
-  | "goto" T_id { $$ = new Goto($2); }
-  | "return" { $$ = new Return(); }
-  | "new" "[" expr "]" l-value { $$ = new New($3, $5); }
-  | "new" l-value { $$ = new New($2); }
-  | "dispose" "[" "]" l-value { $$ = new Dispose($4, true); }
-  | "dispose" l-value { $$ = new Dispose($2, false); }
+  | "if" expr "then" stmt { $$ = new If($2, $4); $$->line = lineOf($2, scanner); }
+  | "if" expr "then" stmt "else" stmt { $$ = new If($2, $4, $6); $$->line = lineOf($2, scanner); }
+  | "while" expr "do" stmt { $$ = new While($2, $4); $$->line = lineOf($2, scanner); }
+  | T_id ":" stmt { $$ = new IdLabel($1, $3); $$->line = $3 ? $3->line : yyget_lineno(scanner); }
+  | "goto" T_id { $$ = new Goto($2); $$->line = yyget_lineno(scanner); }
+  | "return" { $$ = new Return(); $$->line = yyget_lineno(scanner); }
+  | "new" "[" expr "]" l-value { $$ = new New($3, $5); $$->line = lineOf($3, scanner); }
+  | "new" l-value { $$ = new New($2); $$->line = lineOf($2, scanner); }
+  | "dispose" "[" "]" l-value { $$ = new Dispose($4, true); $$->line = lineOf($4, scanner); }
+  | "dispose" l-value { $$ = new Dispose($2, false); $$->line = lineOf($2, scanner); }
   ;
 
 expr:
@@ -276,12 +309,12 @@ expr:
  ;
 
 l-value:
- T_id { $$ = new Id($1); }
- | "result" { $$ = new Result(); }
- | T_const_string { $$ = new Conststring($1); }
- | l-value "[" expr "]" { $$ = new ArrayItem($1, $3); }
+ T_id { $$ = new Id($1); $$->line = yyget_lineno(scanner); }
+ | "result" { $$ = new Result(); $$->line = yyget_lineno(scanner); }
+ | T_const_string { $$ = new Conststring($1); $$->line = yyget_lineno(scanner); }
+ | l-value "[" expr "]" { $$ = new ArrayItem($1, $3); $$->line = $1->line; }
  | "(" l-value ")" { $$ = $2; }
- | expr "^" { $$ = new Dereference($1); }
+ | expr "^" { $$ = new Dereference($1); $$->line = $1->line; }
  ;
 
 r-value:
@@ -294,33 +327,39 @@ r-value:
  | "nil" { $$ = new NilR(); }
  | callr { $$ = $1; }
  | "@" expr { $$ = new Reference($2); }
- | "not" expr { $$ = new UnOp("not", $2);}
- | "+" expr { $$ = new UnOp("+", $2);}
- | "-" expr { $$ = new UnOp("-", $2);}
- | expr "+" expr { $$ = new BinOp($1, "+", $3);  }
- | expr "-" expr { $$ = new BinOp($1, "-", $3);}
- | expr "*" expr { $$ = new BinOp($1, "*", $3);}
- | expr "/" expr { $$ = new BinOp($1, "/", $3);}
- | expr "div" expr { $$ = new BinOp($1, "div", $3);}
- | expr "mod" expr { $$ = new BinOp($1, "mod", $3);}
- | expr "or" expr { $$ = new BinOp($1, "or", $3);}
- | expr "and" expr { $$ = new BinOp($1, "and", $3);}
- | expr "=" expr { $$ = new BinOp($1, "=", $3);  }
- | expr "<>" expr { $$ = new BinOp($1, "<>", $3);}
- | expr "<" expr { $$ = new BinOp($1, "<", $3);}
- | expr "<=" expr { $$ = new BinOp($1, "<=", $3);}
- | expr ">" expr { $$ = new BinOp($1, ">", $3);}
- | expr ">=" expr { $$ = new BinOp($1, ">=", $3);}
+ | "not" expr { $$ = new UnOp("not", $2); $$->line = yyget_lineno(scanner); }
+ | "+" expr { $$ = new UnOp("+", $2); $$->line = yyget_lineno(scanner); }
+ | "-" expr { $$ = new UnOp("-", $2); $$->line = yyget_lineno(scanner); }
+ | expr "+" expr { $$ = new BinOp($1, "+", $3); $$->line = yyget_lineno(scanner); }
+ | expr "-" expr { $$ = new BinOp($1, "-", $3); $$->line = yyget_lineno(scanner); }
+ | expr "*" expr { $$ = new BinOp($1, "*", $3); $$->line = yyget_lineno(scanner); }
+ | expr "/" expr { $$ = new BinOp($1, "/", $3); $$->line = yyget_lineno(scanner); }
+ | expr "div" expr { $$ = new BinOp($1, "div", $3); $$->line = yyget_lineno(scanner); }
+ | expr "mod" expr { $$ = new BinOp($1, "mod", $3); $$->line = yyget_lineno(scanner); }
+ | expr "or" expr { $$ = new BinOp($1, "or", $3); $$->line = yyget_lineno(scanner); }
+ | expr "and" expr { $$ = new BinOp($1, "and", $3); $$->line = yyget_lineno(scanner); }
+ | expr "=" expr { $$ = new BinOp($1, "=", $3); $$->line = yyget_lineno(scanner); }
+ | expr "<>" expr { $$ = new BinOp($1, "<>", $3); $$->line = yyget_lineno(scanner); }
+ | expr "<" expr { $$ = new BinOp($1, "<", $3); $$->line = yyget_lineno(scanner); }
+ | expr "<=" expr { $$ = new BinOp($1, "<=", $3); $$->line = yyget_lineno(scanner); }
+ | expr ">" expr { $$ = new BinOp($1, ">", $3); $$->line = yyget_lineno(scanner); }
+ | expr ">=" expr { $$ = new BinOp($1, ">=", $3); $$->line = yyget_lineno(scanner); }
  ;
 
 call:
-  T_id "(" expr  expr_list  ")" { $4->append_begin($3); $$ = new Call($1, $4); }
-  |T_id "(" ")" { $$ = new Call($1); }
+  T_id call_open expr  expr_list  ")" { $4->append_begin($3); $$ = new Call($1, $4); $$->line = $2; }
+  |T_id call_open ")" { $$ = new Call($1); $$->line = $2; }
   ;
 
 callr:
-  T_id "(" expr  expr_list  ")" { $4->append_begin($3); $$ = new Callr($1, $4);}
-  |T_id "(" ")" { $$ = new Callr($1);}
+  T_id call_open expr  expr_list  ")" { $4->append_begin($3); $$ = new Callr($1, $4); $$->line = $2; }
+  |T_id call_open ")" { $$ = new Callr($1); $$->line = $2; }
+  ;
+
+/* The line of a call, taken at its "(": call and callr only part ways
+   after the ")", when the parser may have read the next line already. */
+call_open:
+  "(" { $$ = yyget_lineno(scanner); }
   ;
 
 expr_list:
@@ -331,10 +370,3 @@ expr_list:
 
 
 %%
-
-int main() {
-
-  int result = yyparse();
-  if (result == 0 && DEBUGPARSER) printf("\nSuccess.\n");
-  return result;
-}
@@ -0,0 +1,232 @@
+/* Buffered input.
+ *
+ * Replaces the lib.a read routines when runtime/libpclrt.a is linked before
+ * lib.a.  A regular file on stdin is mapped whole; anything else is read in
+ * 64 KiB blocks, and the output buffer (runtime/output.c) is flushed before
+ * each block is waited for.  All five routines take their input from the
+ * same place, so they can be mixed freely.
+ *
+ * readInteger, readReal and readBoolean read one word after any white
+ * space, and also take the end of its line when nothing but blanks is left
+ * on it, so that a following readString starts on the next line.  Several
+ * numbers may share a line.  readString reads the rest of the line,
+ * readChar the next character that is not a newline.
+ *
+ * Integers are parsed eight digits at a time (SWAR) and saturate at the
+ * bounds of the language's 32-bit integers, which the compiler truncates
+ * the result to.  Reals whose digits fit in 53 bits and whose exponent is within
+ * 22 are converted exactly with one multiplication or division by a power
+ * of ten (Clinger's fast path); strtod takes the rest.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define IN_SIZE (1 << 16)
+
+void __pcl_output_flush(void) __attribute__((weak));
+
+static char in_buf[IN_SIZE];
+static const char *in_cur, *in_end;
+static int in_state;           /* 0 not started, 1 blocks, 2 mapped, 3 at end */
+
+static void in_start(void) {
+  struct stat st;
+  in_state = 1;
+  in_cur = in_end = in_buf;
+  if (fstat(0, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0) return;
+  off_t at = lseek(0, 0, SEEK_CUR);
+  if (at < 0 || at >= st.st_size) return;
+  void *map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, 0, 0);
+  if (map == MAP_FAILED) return;
+  madvise(map, (size_t) st.st_size, MADV_SEQUENTIAL);
+  in_state = 2;
+  in_cur = (const char *) map + at;
+  in_end = (const char *) map + st.st_size;
+}
+
+/* Whether there is unread input, waiting for it when there is none yet. */
+static int in_fill(void) {
+  if (in_cur < in_end) return 1;
+  if (__builtin_expect(in_state == 0, 0)) {
+    in_start();
+    if (in_cur < in_end) return 1;
+  }
+  if (in_state != 1) return 0;
+  if (__pcl_output_flush) __pcl_output_flush();
+  for (;;) {
+    ssize_t n = read(0, in_buf, IN_SIZE);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) {
+      in_state = 3;
+      return 0;
+    }
+    in_cur = in_buf;
+    in_end = in_buf + n;
+    return 1;
+  }
+}
+
+static inline int is_space(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v';
+}
+
+static inline int is_digit(char c) {
+  return (unsigned char) (c - '0') < 10;
+}
+
+static void skip_space(void) {
+  while (in_fill() && is_space(*in_cur)) in_cur++;
+}
+
+/* After a word: trailing blanks and the newline, if the line ends there. */
+static void skip_line_end(void) {
+  while (in_fill() && (*in_cur == ' ' || *in_cur == '\t' || *in_cur == '\r')) in_cur++;
+  if (in_cur < in_end && *in_cur == '\n') in_cur++;
+}
+
+/* Eight ASCII digits, first digit in the low byte. */
+static inline int all_digits8(uint64_t v) {
+  return ((v & 0xF0F0F0F0F0F0F0F0ull) |
+          (((v + 0x0606060606060606ull) & 0xF0F0F0F0F0F0F0F0ull) >> 4)) ==
+         0x3333333333333333ull;
+}
+
+static inline uint32_t parse_digits8(uint64_t v) {
+  v = ((v & 0x0F0F0F0F0F0F0F0Full) * 2561) >> 8;
+  v = ((v & 0x00FF00FF00FF00FFull) * 6553601) >> 16;
+  return (uint32_t) (((v & 0x0000FFFF0000FFFFull) * 42949672960001ull) >> 32);
+}
+
+int64_t readInteger(void) {
+  skip_space();
+  if (!in_fill()) return 0;
+  int negative = *in_cur == '-';
+  if (*in_cur == '-' || *in_cur == '+') in_cur++;
+  uint64_t limit = negative ? (uint64_t) INT32_MAX + 1 : (uint64_t) INT32_MAX;
+  uint64_t v = 0;
+  int overflow = 0;
+  for (;;) {
+    const char *p = in_cur, *end = in_end;
+    uint64_t chunk;
+    while (end - p >= 8 && (memcpy(&chunk, p, 8), all_digits8(chunk))) {
+      overflow |= __builtin_mul_overflow(v, 100000000u, &v);
+      overflow |= __builtin_add_overflow(v, parse_digits8(chunk), &v);
+      p += 8;
+    }
+    while (p < end && is_digit(*p)) {
+      overflow |= __builtin_mul_overflow(v, 10u, &v);
+      overflow |= __builtin_add_overflow(v, (unsigned) (*p - '0'), &v);
+      p++;
+    }
+    in_cur = p;
+    if (p < end || !in_fill()) break;   /* the number may go on in the next block */
+  }
+  skip_line_end();
+  if (overflow || v > limit) v = limit;
+  return negative ? (int64_t) (0 - v) : (int64_t) v;
+}
+
+static const double exact_powers[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+/* The exact value of s when Clinger's fast path applies. */
+static int fast_real(const char *s, double *out) {
+  int negative = *s == '-';
+  if (*s == '-' || *s == '+') s++;
+  uint64_t m = 0;
+  int digits = 0, exponent = 0, any = 0;
+  for (; is_digit(*s); s++, any = 1) {
+    if (m == 0 && *s == '0') continue;
+    if (++digits > 19) return 0;
+    m = m * 10 + (uint64_t) (*s - '0');
+  }
+  if (*s == '.') {
+    for (s++; is_digit(*s); s++, any = 1) {
+      exponent--;
+      if (m == 0 && *s == '0') continue;
+      if (++digits > 19) return 0;
+      m = m * 10 + (uint64_t) (*s - '0');
+    }
+  }
+  if (!any) return 0;
+  if (*s == 'e' || *s == 'E') {
+    s++;
+    int sign = *s == '-' ? -1 : 1;
+    if (*s == '-' || *s == '+') s++;
+    if (!is_digit(*s)) return 0;
+    int e = 0;
+    for (; is_digit(*s); s++) {
+      if (e < 10000) e = e * 10 + (*s - '0');
+    }
+    exponent += sign * e;
+  }
+  if (*s != '\0') return 0;
+  /* Both m and the power of ten are exact doubles, one rounding follows. */
+  if (m > (1ull << 53) || exponent < -22 || exponent > 22) return 0;
+  double v = (double) m;
+  v = exponent < 0 ? v / exact_powers[-exponent] : v * exact_powers[exponent];
+  *out = negative ? -v : v;
+  return 1;
+}
+
+double readReal(void) {
+  char word[64];
+  size_t n = 0;
+  skip_space();
+  while (in_fill() && !is_space(*in_cur)) {
+    if (n < sizeof word - 1) word[n++] = *in_cur;
+    in_cur++;
+  }
+  word[n] = '\0';
+  skip_line_end();
+  double v;
+  if (fast_real(word, &v)) return v;
+  return strtod(word, NULL);
+}
+
+int8_t readBoolean(void) {
+  skip_space();
+  if (!in_fill()) return 0;
+  int t = (*in_cur | 0x20) == 't';
+  while (in_fill() && !is_space(*in_cur)) in_cur++;
+  skip_line_end();
+  return (int8_t) t;
+}
+
+int8_t readChar(void) {
+  while (in_fill() && *in_cur == '\n') in_cur++;
+  if (in_cur == in_end) return 0;
+  return *in_cur++;
+}
+
+/* The rest of the line, at most size - 1 characters, without its newline. */
+void readString(int64_t size, char *s) {
+  if (size <= 0) return;
+  size_t n = 0, room = (size_t) size - 1;
+  while (n < room && in_fill()) {
+    size_t take = (size_t) (in_end - in_cur);
+    if (take > room - n) take = room - n;
+    const char *nl = memchr(in_cur, '\n', take);
+    if (nl) {
+      memcpy(s + n, in_cur, (size_t) (nl - in_cur));
+      n += (size_t) (nl - in_cur);
+      in_cur = nl + 1;
+      s[n] = '\0';
+      return;
+    }
+    memcpy(s + n, in_cur, take);
+    n += take;
+    in_cur += take;
+  }
+  /* A full string whose newline is already here takes it too. */
+  if (in_cur < in_end && *in_cur == '\n') in_cur++;
+  s[n] = '\0';
+}
@@ -0,0 +1,139 @@
+/* Buffered output.
+ *
+ * The lib.a write routines make one write(2) per value.  These replace
+ * them when runtime/libpclrt.a is linked before lib.a: values are
+ * formatted straight into one per-process buffer, which is written when it
+ * fills, before the program waits for input (runtime/input.c, so prompts
+ * appear) and when the program exits.  On a terminal every write is flushed
+ * at once, as before.
+ *
+ * Integers are formatted two digits at a time from a table, reals in the
+ * shortest form that reads back as the same double, strings are copied by
+ * length.  Booleans and characters print as lib.a prints them.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define OUT_SIZE (1 << 16)
+
+static char out_buf[OUT_SIZE];
+static size_t out_len;
+static int out_state;          /* 0 unknown, 1 buffered, 2 a terminal */
+
+static const char digit_pairs[201] =
+  "00010203040506070809"
+  "10111213141516171819"
+  "20212223242526272829"
+  "30313233343536373839"
+  "40414243444546474849"
+  "50515253545556575859"
+  "60616263646566676869"
+  "70717273747576777879"
+  "80818283848586878889"
+  "90919293949596979899";
+
+static void out_write(const char *p, size_t n) {
+  while (n > 0) {
+    ssize_t w = write(1, p, n);
+    if (w < 0) {
+      if (errno == EINTR) continue;
+      return;                  /* nowhere to report it, drop the output */
+    }
+    p += w;
+    n -= (size_t) w;
+  }
+}
+
+void __pcl_output_flush(void) {
+  out_write(out_buf, out_len);
+  out_len = 0;
+}
+
+static void out_start(void) {
+  out_state = isatty(1) ? 2 : 1;
+  atexit(__pcl_output_flush);
+}
+
+/* Room for n more bytes, n <= OUT_SIZE. */
+static inline char *out_reserve(size_t n) {
+  if (__builtin_expect(out_state == 0, 0)) out_start();
+  if (__builtin_expect(out_len + n > OUT_SIZE, 0)) __pcl_output_flush();
+  return out_buf + out_len;
+}
+
+static inline void out_done(size_t n) {
+  out_len += n;
+  if (__builtin_expect(out_state == 2, 0)) __pcl_output_flush();
+}
+
+static void out_bytes(const char *s, size_t n) {
+  if (n > OUT_SIZE / 2) {
+    /* Long strings go out as they are, after what is buffered. */
+    out_reserve(0);
+    __pcl_output_flush();
+    out_write(s, n);
+    return;
+  }
+  memcpy(out_reserve(n), s, n);
+  out_done(n);
+}
+
+void writeInteger(int64_t n) {
+  char tmp[20], *p = tmp + sizeof tmp;
+  uint64_t u = n < 0 ? 0 - (uint64_t) n : (uint64_t) n;
+  while (u >= 100) {
+    unsigned d = (unsigned) (u % 100) * 2;
+    u /= 100;
+    p -= 2;
+    memcpy(p, digit_pairs + d, 2);
+  }
+  if (u >= 10) {
+    p -= 2;
+    memcpy(p, digit_pairs + u * 2, 2);
+  } else {
+    *--p = (char) ('0' + u);
+  }
+  if (n < 0) *--p = '-';
+  size_t len = (size_t) (tmp + sizeof tmp - p);
+  memcpy(out_reserve(len), p, len);
+  out_done(len);
+}
+
+void writeReal(double r) {
+  /* A double with at most 15 significant digits survives the trip through
+   * decimal, so %.15g is shortest whenever it reads back; 17 always does. */
+  char tmp[32];
+  int len = 0;
+  for (int precision = 15; precision <= 17; precision++) {
+    len = snprintf(tmp, sizeof tmp, "%.*g", precision, r);
+    if (r != r || strtod(tmp, NULL) == r) break;
+  }
+  out_bytes(tmp, (size_t) len);
+}
+
+void writeBoolean(int8_t b) {
+  if (b) out_bytes("true\n", 5);
+  else out_bytes("false\n", 6);
+}
+
+void writeChar(int8_t c) {
+  if (c == 0) return;
+  *out_reserve(1) = (char) c;
+  out_done(1);
+}
+
+void writeString(const char *s) {
+  /* Not strlen: lib.a defines its own, and it may be the one linked. */
+  const char *end = memchr(s, 0, PTRDIFF_MAX);
+  out_bytes(s, (size_t) (end - s));
+}
+
+/* writeString of a literal, whose length the compiler knows. */
+void __pcl_write_string_n(const char *s, int64_t n) {
+  out_bytes(s, (size_t) n);
+}
@@ -0,0 +1,137 @@
+/* Per-procedure call count and cycle profiler.
+ *
+ * Programs compiled with `pcl --profile-procedures` call __pcl_prof_init
+ * once from main and __pcl_prof_enter/__pcl_prof_exit around the body of
+ * every routine.  Times are taken with rdtsc and attributed on a shadow
+ * stack; the flat profile and the call graph are printed to stderr when
+ * the program exits.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <x86intrin.h>
+
+#define PROF_MAX_DEPTH 4096
+#define PROF_EDGES     4096   /* power of two */
+
+struct prof_proc {
+  uint64_t calls;
+  uint64_t self;
+  uint64_t inclusive;
+  int active;                 /* activations on the stack, for recursion */
+};
+
+struct prof_frame {
+  int id;
+  uint64_t start;
+  uint64_t children;
+};
+
+struct prof_edge {
+  int caller, callee;         /* caller -1 marks an empty slot */
+  uint64_t calls;
+  uint64_t inclusive;
+};
+
+static const char **prof_names;
+static int prof_count;
+static struct prof_proc *prof_procs;
+static struct prof_frame prof_stack[PROF_MAX_DEPTH];
+static int prof_depth;
+static struct prof_edge prof_edges[PROF_EDGES];
+static uint64_t prof_lost;
+
+static struct prof_edge *prof_edge(int caller, int callee) {
+  unsigned h = ((unsigned) caller * 31u + (unsigned) callee) & (PROF_EDGES - 1);
+  for (int i = 0; i < PROF_EDGES; i++) {
+    struct prof_edge *e = &prof_edges[(h + i) & (PROF_EDGES - 1)];
+    if (e->caller == caller && e->callee == callee) return e;
+    if (e->caller == -1) {
+      e->caller = caller;
+      e->callee = callee;
+      return e;
+    }
+  }
+  return NULL;
+}
+
+void __pcl_prof_enter(int id) {
+  if (prof_depth == PROF_MAX_DEPTH) { prof_lost++; return; }
+  struct prof_frame *f = &prof_stack[prof_depth++];
+  f->id = id;
+  f->children = 0;
+  prof_procs[id].calls++;
+  prof_procs[id].active++;
+  f->start = __rdtsc();
+}
+
+void __pcl_prof_exit(int id) {
+  uint64_t now = __rdtsc();
+  if (prof_depth == 0 || prof_stack[prof_depth - 1].id != id) { prof_lost++; return; }
+  struct prof_frame *f = &prof_stack[--prof_depth];
+  uint64_t total = now - f->start;
+  struct prof_proc *p = &prof_procs[id];
+  p->self += total - f->children;
+  /* Recursive activations are already part of the outermost one. */
+  if (--p->active == 0) p->inclusive += total;
+  if (prof_depth > 0) {
+    prof_stack[prof_depth - 1].children += total;
+    struct prof_edge *e = prof_edge(prof_stack[prof_depth - 1].id, id);
+    if (e) { e->calls++; e->inclusive += total; }
+  }
+}
+
+static int prof_by_self(const void *a, const void *b) {
+  uint64_t x = prof_procs[*(const int *) a].self, y = prof_procs[*(const int *) b].self;
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static void prof_report(void) {
+  uint64_t total = 0;
+  int *order = malloc(prof_count * sizeof(int));
+  for (int i = 0; i < prof_count; i++) { order[i] = i; total += prof_procs[i].self; }
+  qsort(order, prof_count, sizeof(int), prof_by_self);
+  if (total == 0) total = 1;
+
+  fprintf(stderr, "\nFlat profile (cycles):\n");
+  fprintf(stderr, "%7s %12s %16s %16s  %s\n", "%self", "calls", "self", "inclusive", "procedure");
+  for (int k = 0; k < prof_count; k++) {
+    struct prof_proc *p = &prof_procs[order[k]];
+    if (p->calls == 0) continue;
+    fprintf(stderr, "%6.2f%% %12llu %16llu %16llu  %s\n", 100.0 * p->self / total,
+            (unsigned long long) p->calls, (unsigned long long) p->self,
+            (unsigned long long) p->inclusive, prof_names[order[k]]);
+  }
+
+  fprintf(stderr, "\nCall graph (cycles):\n");
+  for (int k = 0; k < prof_count; k++) {
+    int id = order[k];
+    if (prof_procs[id].calls == 0) continue;
+    fprintf(stderr, "%s\n", prof_names[id]);
+    for (int i = 0; i < PROF_EDGES; i++) {
+      struct prof_edge *e = &prof_edges[i];
+      if (e->caller == id)
+        fprintf(stderr, "    -> %-24s %12llu calls %16llu cycles\n", prof_names[e->callee],
+                (unsigned long long) e->calls, (unsigned long long) e->inclusive);
+    }
+  }
+  if (prof_lost)
+    fprintf(stderr, "\n%llu unmatched entries or exits were ignored\n", (unsigned long long) prof_lost);
+  free(order);
+}
+
+/* main may return without leaving its own activation, close what is open. */
+static void prof_finish(void) {
+  while (prof_depth > 0) __pcl_prof_exit(prof_stack[prof_depth - 1].id);
+  prof_report();
+}
+
+void __pcl_prof_init(const char **names, int count) {
+  prof_names = names;
+  prof_count = count;
+  prof_procs = calloc(count, sizeof(struct prof_proc));
+  for (int i = 0; i < PROF_EDGES; i++) prof_edges[i].caller = -1;
+  atexit(prof_finish);
+}
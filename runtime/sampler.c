@@ -0,0 +1,239 @@
+/* Statistical profiler driven by SIGPROF.
+ *
+ * Programs compiled with `pcl --profile-sample` keep frame pointers and
+ * call __pcl_sample_init from main with a table of their routines (entry
+ * address, PCL name, source line) plus an end-of-text sentinel that
+ * bounds the last one.  The compiler also leaves the address and line of
+ * every statement in the pcl_lines section.  Every tick the signal
+ * handler walks the frame pointer chain and pushes the return addresses
+ * into a lock-free ring buffer, which is folded into a table of distinct
+ * stacks whenever it fills up.  At exit the stacks are symbolized and
+ * written as folded stacks for flamegraph.pl to PCL_SAMPLE_OUTPUT
+ * (default pcl.folded), each frame as routine:line of the statement it
+ * was in.  PCL_SAMPLE_HZ sets the sampling rate.
+ */
+
+#define _GNU_SOURCE
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <ucontext.h>
+
+#define SAMPLE_DEPTH  32
+#define SAMPLE_RING   4096    /* power of two */
+#define SAMPLE_STACKS 16384   /* power of two */
+
+struct sample_symbol {
+  const void *addr;
+  const char *name;           /* NULL for the end-of-text sentinel */
+  int line;
+};
+
+/* One entry of the pcl_lines section, as --profile-sample emits it. */
+struct sample_line {
+  const void *addr;
+  int line;
+  int pad;
+};
+
+struct sample {
+  int depth;
+  uintptr_t pc[SAMPLE_DEPTH];
+};
+
+struct sample_stack {
+  uint64_t hash;              /* 0 marks an empty slot */
+  uint64_t count;
+  struct sample s;
+};
+
+static const struct sample_symbol *sample_symbols;
+static int sample_nsymbols;
+/* Bounds of pcl_lines, defined by the linker when a program has one. */
+extern const struct sample_line __start_pcl_lines[] __attribute__((weak));
+extern const struct sample_line __stop_pcl_lines[] __attribute__((weak));
+static const struct sample_line *sample_lines;
+static int sample_nlines;
+
+static struct sample sample_ring[SAMPLE_RING];
+static volatile unsigned sample_head, sample_tail;
+static struct sample_stack sample_stacks[SAMPLE_STACKS];
+static uint64_t sample_dropped;
+/* End of the main stack, 0 when unknown: only the pc is sampled then. */
+static uintptr_t sample_stack_top;
+
+static uint64_t sample_hash(const struct sample *s) {
+  uint64_t h = 1469598103934665603ull;
+  for (int i = 0; i < s->depth; i++) h = (h ^ s->pc[i]) * 1099511628211ull;
+  return h ? h : 1;
+}
+
+/* Consumer side of the ring, only ever run with SIGPROF blocked. */
+static void sample_drain(void) {
+  unsigned head = __atomic_load_n(&sample_head, __ATOMIC_ACQUIRE);
+  unsigned tail = sample_tail;
+  for (; tail != head; tail++) {
+    const struct sample *s = &sample_ring[tail & (SAMPLE_RING - 1)];
+    uint64_t h = sample_hash(s);
+    int i;
+    for (i = 0; i < SAMPLE_STACKS; i++) {
+      struct sample_stack *e = &sample_stacks[(h + i) & (SAMPLE_STACKS - 1)];
+      if (e->hash == 0) { e->hash = h; e->s = *s; }
+      if (e->hash == h && e->s.depth == s->depth &&
+          !memcmp(e->s.pc, s->pc, s->depth * sizeof(uintptr_t))) {
+        e->count++;
+        break;
+      }
+    }
+    if (i == SAMPLE_STACKS) sample_dropped++;
+  }
+  __atomic_store_n(&sample_tail, tail, __ATOMIC_RELEASE);
+}
+
+static void sample_handler(int sig, siginfo_t *info, void *context) {
+  (void) sig; (void) info;
+  ucontext_t *uc = context;
+  unsigned head = sample_head;
+  if (head - __atomic_load_n(&sample_tail, __ATOMIC_ACQUIRE) == SAMPLE_RING) {
+    sample_dropped++;
+    return;
+  }
+  struct sample *s = &sample_ring[head & (SAMPLE_RING - 1)];
+  uintptr_t sp = (uintptr_t) uc->uc_mcontext.gregs[REG_RSP];
+  uintptr_t fp = (uintptr_t) uc->uc_mcontext.gregs[REG_RBP];
+  s->pc[0] = (uintptr_t) uc->uc_mcontext.gregs[REG_RIP];
+  s->depth = 1;
+  /* Code without frame pointers (libc, the runtime) leaves anything in RBP,
+   * so a frame is read only when it lies between the interrupted stack
+   * pointer and the top of the stack, each one above the last. */
+  while (s->depth < SAMPLE_DEPTH && fp >= sp && (fp & 7) == 0 &&
+         fp + 2 * sizeof(uintptr_t) <= sample_stack_top) {
+    const uintptr_t *frame = (const uintptr_t *) fp;
+    if (frame[1] == 0) break;
+    s->pc[s->depth++] = frame[1] - 1;  /* inside the call instruction */
+    sp = fp + 2 * sizeof(uintptr_t);
+    fp = frame[0];
+  }
+  __atomic_store_n(&sample_head, head + 1, __ATOMIC_RELEASE);
+  if (head + 1 - sample_tail >= SAMPLE_RING / 2) sample_drain();
+}
+
+/* Largest symbol address not above pc, as long as pc is before the next one. */
+static const struct sample_symbol *sample_lookup(uintptr_t pc) {
+  int lo = 0, hi = sample_nsymbols - 1, found = -1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if ((uintptr_t) sample_symbols[mid].addr <= pc) { found = mid; lo = mid + 1; }
+    else hi = mid - 1;
+  }
+  if (found < 0 || !sample_symbols[found].name) return NULL;
+  return &sample_symbols[found];
+}
+
+/* Line of the statement pc is in: the last one starting at or before pc,
+ * as long as it is in the routine sym, else the routine's own line. */
+static int sample_line_of(uintptr_t pc, const struct sample_symbol *sym) {
+  int lo = 0, hi = sample_nlines - 1, found = -1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if ((uintptr_t) sample_lines[mid].addr <= pc) { found = mid; lo = mid + 1; }
+    else hi = mid - 1;
+  }
+  if (found < 0 || sample_lines[found].addr < sym->addr) return sym->line;
+  return sample_lines[found].line;
+}
+
+static int sample_by_addr(const void *a, const void *b) {
+  uintptr_t x = (uintptr_t) ((const struct sample_symbol *) a)->addr;
+  uintptr_t y = (uintptr_t) ((const struct sample_symbol *) b)->addr;
+  return x < y ? -1 : x > y;
+}
+
+static int sample_line_by_addr(const void *a, const void *b) {
+  uintptr_t x = (uintptr_t) ((const struct sample_line *) a)->addr;
+  uintptr_t y = (uintptr_t) ((const struct sample_line *) b)->addr;
+  return x < y ? -1 : x > y;
+}
+
+static void sample_report(void) {
+  struct itimerval off;
+  memset(&off, 0, sizeof(off));
+  setitimer(ITIMER_PROF, &off, NULL);
+  signal(SIGPROF, SIG_IGN);
+  sample_drain();
+
+  const char *path = getenv("PCL_SAMPLE_OUTPUT");
+  FILE *out = fopen(path ? path : "pcl.folded", "w");
+  if (!out) { perror("pcl sampler"); return; }
+  for (int i = 0; i < SAMPLE_STACKS; i++) {
+    struct sample_stack *e = &sample_stacks[i];
+    if (e->hash == 0) continue;
+    int first = 1;
+    for (int k = e->s.depth - 1; k >= 0; k--) {
+      const struct sample_symbol *sym = sample_lookup(e->s.pc[k]);
+      if (!sym && k > 0) continue;  /* frames of libc and the runtime */
+      fprintf(out, first ? "" : ";");
+      if (sym) fprintf(out, "%s:%d", sym->name, sample_line_of(e->s.pc[k], sym));
+      else fprintf(out, "[runtime]");
+      first = 0;
+    }
+    fprintf(out, " %llu\n", (unsigned long long) e->count);
+  }
+  fclose(out);
+  if (sample_dropped)
+    fprintf(stderr, "pcl sampler: %llu samples dropped\n", (unsigned long long) sample_dropped);
+}
+
+/* The main stack's mapping, the handler never reads above it. */
+static uintptr_t sample_find_stack_top(void) {
+  FILE *maps = fopen("/proc/self/maps", "r");
+  if (!maps) return 0;
+  char line[512];
+  uintptr_t top = 0;
+  while (fgets(line, sizeof line, maps)) {
+    unsigned long lo, hi;
+    if (strstr(line, "[stack]") && sscanf(line, "%lx-%lx", &lo, &hi) == 2) {
+      top = hi;
+      break;
+    }
+  }
+  fclose(maps);
+  return top;
+}
+
+void __pcl_sample_init(const struct sample_symbol *symbols, int count) {
+  struct sample_symbol *sorted = malloc(count * sizeof(*sorted));
+  memcpy(sorted, symbols, count * sizeof(*sorted));
+  qsort(sorted, count, sizeof(*sorted), sample_by_addr);
+  sample_symbols = sorted;
+  sample_nsymbols = count;
+  const struct sample_line *begin = __start_pcl_lines, *end = __stop_pcl_lines;
+  if (begin && end > begin) {
+    int n = end - begin;
+    struct sample_line *lines = malloc(n * sizeof(*lines));
+    memcpy(lines, begin, n * sizeof(*lines));
+    qsort(lines, n, sizeof(*lines), sample_line_by_addr);
+    sample_lines = lines;
+    sample_nlines = n;
+  }
+  sample_stack_top = sample_find_stack_top();
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_sigaction = sample_handler;
+  sa.sa_flags = SA_SIGINFO | SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGPROF, &sa, NULL);
+
+  const char *hz = getenv("PCL_SAMPLE_HZ");
+  long usec = 1000000 / (hz && atol(hz) > 0 ? atol(hz) : 997);
+  struct itimerval timer;
+  timer.it_interval.tv_sec = usec / 1000000;
+  timer.it_interval.tv_usec = usec % 1000000;
+  timer.it_value = timer.it_interval;
+  atexit(sample_report);
+  setitimer(ITIMER_PROF, &timer, NULL);
+}
@@ -0,0 +1,22 @@
+/* Arithmetic traps.
+ *
+ * Programs compiled with `pcl --check-overflow` branch to __pcl_arith_error
+ * when an integer +, -, *, div or mod overflows or divides by zero.  It
+ * reports the source line and aborts, after what the program printed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+void __pcl_output_flush(void) __attribute__((weak));
+
+enum { ARITH_OVERFLOW, ARITH_DIVISION_BY_ZERO };
+
+__attribute__((noreturn, cold))
+void __pcl_arith_error(int line, int kind) {
+  if (__pcl_output_flush) __pcl_output_flush();
+  fprintf(stderr, "pcl: line %d: %s\n", line,
+          kind == ARITH_DIVISION_BY_ZERO ? "division by zero" : "integer overflow");
+  fflush(stderr);
+  abort();
+}
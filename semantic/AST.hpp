@@ -1,4 +1,5 @@
 #include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/InlineAsm.h>
 #include <llvm/IR/LegacyPassManager.h>
 #include <llvm/IR/Module.h>
 #include <llvm/IR/Value.h>
@@ -6,37 +7,107 @@
 #include <llvm/Support/raw_ostream.h>
 #include <llvm/Transforms/Scalar.h>
 #include <llvm/Transforms/Scalar/GVN.h>
+#include <llvm/Transforms/IPO.h>
+#include <llvm/Transforms/Instrumentation.h>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <unordered_set>
+#include <vector>
+#include "options.hpp"
+#include "diagnostics.hpp"
 using namespace llvm;
+
+class AST;
+// Owns the nodes and types allocated while it is current: the tree of one
+// compile, what sem added to it and what a failed parse left behind. Nodes
+// do not delete their children, sem shares and replaces them too freely;
+// the arena deletes them all at once.
+class AstArena {
+public:
+  AstArena() {}
+  AstArena(const AstArena &) = delete;
+  AstArena &operator=(const AstArena &) = delete;
+  ~AstArena();
+  // Makes an arena current for a scope.
+  class Use {
+  public:
+    explicit Use(AstArena *arena) : previous(current) { current = arena; }
+    ~Use() { current = previous; }
+  private:
+    AstArena *previous;
+  };
+  static thread_local AstArena *current;
+private:
+  friend class AST;
+  std::vector<AST *> order;
+  std::unordered_set<AST *> live;
+};
+
 class AST {
 public:
   virtual ~AST() {}
+  // Every node keeps the arena it was allocated in just in front of it.
+  static void *operator new(size_t size);
+  static void operator delete(void *p);
   virtual void printOn(std::ostream &out) const = 0;
   virtual std::string getStringName(){ return "AST()";}
   virtual void sem() {}
   virtual void semForward(){}
   void ERROR (const char * fmt, ...){
-    std::cout << fmt ;
+    diag() << fmt ;
   };
-  // Global LLVM variables related to the LLVM suite.
-  static LLVMContext TheContext;
-  static IRBuilder<> Builder;
-  static std::unique_ptr<Module> TheModule;
-  static std::unique_ptr<legacy::FunctionPassManager> TheFPM;
+  // Structural hash of the subtree, computed on first use. Structurally
+  // equal nodes hash alike, sameAs confirms a match.
+  uint64_t fingerprint() {
+    if(!fingerprinted){
+      fingerprintValue = computeFingerprint();
+      fingerprinted = true;
+    }
+    return fingerprintValue;
+  }
+  virtual bool sameAs(AST *that) {
+    return fingerprint() == that->fingerprint() && getStringName() == that->getStringName();
+  }
+protected:
+  // Nodes that are compared on hot paths override both, the rest fall back
+  // on their printed form.
+  virtual uint64_t computeFingerprint() {
+    std::string s = getStringName();
+    return hashString(s.c_str());
+  }
+  static uint64_t mix(uint64_t h, uint64_t v) {
+    return h ^ (v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2));
+  }
+  static uint64_t hashString(const char *c) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (; c && *c; ++c) h = (h ^ (unsigned char)*c) * 0x100000001b3ULL;
+    return h;
+  }
+  static uint64_t fingerprintOf(AST *a) { return a ? a->fingerprint() : 0; }
+  static bool sameNode(AST *a, AST *b) {
+    if(!a || !b) return a == b;
+    return a->sameAs(b);
+  }
+public:
+  // Global LLVM variables related to the LLVM suite. They are per thread,
+  // so that every thread of pcl -j is a compiler of its own.
+  static thread_local LLVMContext TheContext;
+  static thread_local IRBuilder<> Builder;
+  static thread_local std::unique_ptr<Module> TheModule;
+  static thread_local std::unique_ptr<legacy::FunctionPassManager> TheFPM;
 
   // Global LLVM variables related to the generated code.
-  static GlobalVariable *TheVars;
-  static GlobalVariable *TheRealVars;
-  static GlobalVariable *TheNL;
-  static Function *TheWriteInteger;
-  static Function *TheWriteReal;
-  static Function *TheWriteString;
+  static thread_local GlobalVariable *TheVars;
+  static thread_local GlobalVariable *TheRealVars;
+  static thread_local GlobalVariable *TheNL;
 
   // Useful LLVM types.
-  static Type *i1;
-  static Type *i8;
-  static Type *i32;
-  static Type *i64;
-  static Type *DoubleTyID;
+  static thread_local Type *i1;
+  static thread_local Type *i8;
+  static thread_local Type *i32;
+  static thread_local Type *i64;
+  static thread_local Type *DoubleTyID;
 
 
   // Useful LLVM helper functions.
@@ -54,16 +125,120 @@ public:
   }
   virtual Value* compile() const = 0;
   virtual Value* compile_r() const = 0;
-  void llvm_compile_and_dump() {
-    // Initialize the module and the optimization passes.
+  // Wraps every defined function with calls to the procedure profiler of
+  // the runtime (runtime/profile.c), main registers the procedure names.
+  void instrument_procedures(Function *main) {
+    FunctionType *hook_type =
+      FunctionType::get(Type::getVoidTy(TheContext),
+                        std::vector<Type *> { i32 }, false);
+    Function *enter =
+      Function::Create(hook_type, Function::ExternalLinkage,
+                       "__pcl_prof_enter", TheModule.get());
+    Function *leave =
+      Function::Create(hook_type, Function::ExternalLinkage,
+                       "__pcl_prof_exit", TheModule.get());
+    Type *str_type = PointerType::get(i8, 0);
+    std::vector<Constant *> names;
+    for (Function &F : *TheModule) {
+      if (F.isDeclaration()) continue;
+      Value *id = c32(names.size());
+      Constant *name = ConstantDataArray::getString(TheContext, F.getName());
+      GlobalVariable *gv = new GlobalVariable(
+          *TheModule, name->getType(), true, GlobalValue::PrivateLinkage,
+          name, "prof_name");
+      names.push_back(ConstantExpr::getInBoundsGetElementPtr(
+          name->getType(), gv, std::vector<Constant *> { c32(0), c32(0) }));
+
+      IRBuilder<> Entry(&F.getEntryBlock(), F.getEntryBlock().getFirstInsertionPt());
+      Entry.CreateCall(enter, std::vector<Value *> { id });
+      for (BasicBlock &BB : F) {
+        if (!dyn_cast_or_null<ReturnInst>(BB.getTerminator())) continue;
+        IRBuilder<> Exit(BB.getTerminator());
+        Exit.CreateCall(leave, std::vector<Value *> { id });
+      }
+    }
+    ArrayType *names_type = ArrayType::get(str_type, names.size());
+    GlobalVariable *table = new GlobalVariable(
+        *TheModule, names_type, true, GlobalValue::PrivateLinkage,
+        ConstantArray::get(names_type, names), "prof_names");
+    FunctionType *init_type =
+      FunctionType::get(Type::getVoidTy(TheContext),
+                        std::vector<Type *> { PointerType::get(str_type, 0), i32 }, false);
+    Function *init =
+      Function::Create(init_type, Function::ExternalLinkage,
+                       "__pcl_prof_init", TheModule.get());
+    IRBuilder<> Start(&main->getEntryBlock(), main->getEntryBlock().begin());
+    Start.CreateCall(init, std::vector<Value *> {
+        Start.CreatePointerCast(table, PointerType::get(str_type, 0)),
+        c32(names.size()) });
+  }
+  // Keeps frame pointers in every defined function and has main register
+  // them with the sampling profiler of the runtime (runtime/sampler.c).
+  void instrument_sampling(Function *main) {
+    Type *str_type = PointerType::get(i8, 0);
+    StructType *sym_type = StructType::get(TheContext,
+        std::vector<Type *> { str_type, str_type, i32 });
+    // Bounds the address range of the last routine.
+    Function *text_end =
+      Function::Create(FunctionType::get(Type::getVoidTy(TheContext), false),
+                       Function::InternalLinkage, "__pcl_sample_text_end",
+                       TheModule.get());
+    IRBuilder<>(BasicBlock::Create(TheContext, "entry", text_end)).CreateRetVoid();
+
+    std::vector<Constant *> symbols;
+    for (Function &F : *TheModule) {
+      if (F.isDeclaration()) continue;
+      F.addFnAttr("frame-pointer", "all");
+      F.addFnAttr("no-frame-pointer-elim", "true");
+      Constant *addr = ConstantExpr::getPointerCast(&F, str_type);
+      Constant *name = ConstantPointerNull::get(PointerType::get(i8, 0));
+      int line = 0;
+      if (&F != text_end) {
+        Constant *str = ConstantDataArray::getString(TheContext, F.getName());
+        GlobalVariable *gv = new GlobalVariable(
+            *TheModule, str->getType(), true, GlobalValue::PrivateLinkage,
+            str, "sample_name");
+        name = ConstantExpr::getInBoundsGetElementPtr(
+            str->getType(), gv, std::vector<Constant *> { c32(0), c32(0) });
+      }
+      if (MDNode *md = F.getMetadata("pcl.line"))
+        line = mdconst::extract<ConstantInt>(md->getOperand(0))->getZExtValue();
+      symbols.push_back(ConstantStruct::get(sym_type,
+          std::vector<Constant *> { addr, name, c32(line) }));
+    }
+    ArrayType *table_type = ArrayType::get(sym_type, symbols.size());
+    GlobalVariable *table = new GlobalVariable(
+        *TheModule, table_type, true, GlobalValue::PrivateLinkage,
+        ConstantArray::get(table_type, symbols), "sample_symbols");
+    FunctionType *init_type =
+      FunctionType::get(Type::getVoidTy(TheContext),
+                        std::vector<Type *> { PointerType::get(sym_type, 0), i32 }, false);
+    Function *init =
+      Function::Create(init_type, Function::ExternalLinkage,
+                       "__pcl_sample_init", TheModule.get());
+    IRBuilder<> Start(&main->getEntryBlock(), main->getEntryBlock().begin());
+    Start.CreateCall(init, std::vector<Value *> {
+        Start.CreatePointerCast(table, PointerType::get(sym_type, 0)),
+        c32(symbols.size()) });
+  }
+  // Under --profile-sample, records where the code of a statement starts:
+  // an entry of its address and line in the pcl_lines section, which the
+  // sampler looks the sampled addresses up in.
+  void markLine(int line) const {
+    if (!opts.profileSample || !line) return;
+    std::string text = "1:\n\t.pushsection pcl_lines,\"aw\"\n\t.balign 8\n\t.quad 1b\n\t.long " +
+                       std::to_string(line) + "\n\t.long 0\n\t.popsection";
+    Builder.CreateCall(InlineAsm::get(FunctionType::get(Type::getVoidTy(TheContext), false),
+                                      text, "", true));
+  }
+  void llvm_compile_and_dump(raw_ostream &out = outs()) {
+    llvm_compile();
+    llvm_dump(out);
+  }
+
+  // Builds TheModule from the checked program.
+  void llvm_compile() {
     TheModule = make_unique<Module>("pcl program", TheContext);
-    TheFPM = make_unique<legacy::FunctionPassManager>(TheModule.get());
-    TheFPM->add(createPromoteMemoryToRegisterPass());
-    TheFPM->add(createInstructionCombiningPass());
-    TheFPM->add(createReassociatePass());
-    TheFPM->add(createGVNPass());
-    TheFPM->add(createCFGSimplificationPass());
-    TheFPM->doInitialization();
     // Define and initialize global symbols.
     // @vars = global [26 x i32] zeroinitializer, align 16
     ArrayType *vars_type = ArrayType::get(i32, 26);
@@ -86,27 +261,7 @@ public:
           std::vector<Constant *> { c8('\n'), c8('\0') }
         ), "nl");
     TheNL->setAlignment(1);
-    // declare void @writeInteger(i64)
-    FunctionType *writeInteger_type =
-      FunctionType::get(Type::getVoidTy(TheContext),
-                        std::vector<Type *> { i64 }, false);
-    FunctionType *writeReal_type =
-      FunctionType::get(Type::getVoidTy(TheContext),
-                        std::vector<Type *> { DoubleTyID  }, false);
-
-    TheWriteInteger =
-      Function::Create(writeInteger_type, Function::ExternalLinkage,
-                       "writeInteger", TheModule.get());
-    TheWriteReal =
-      Function::Create(writeReal_type, Function::ExternalLinkage,
-                       "writeReal", TheModule.get());
-    // declare void @writeString(i8*)
-    FunctionType *writeString_type =
-      FunctionType::get(Type::getVoidTy(TheContext),
-                        std::vector<Type *> { PointerType::get(i8, 0) }, false);
-    TheWriteString =
-      Function::Create(writeString_type, Function::ExternalLinkage,
-                       "writeString", TheModule.get());
+    // The library routines are declared as the program calls them.
     // Define and start the main function.
 
     Function *main =
@@ -117,20 +272,86 @@ public:
     // Emit the program code.
     compile();
     Builder.CreateRet(c32(0));
+    if(opts.profileProcedures) instrument_procedures(main);
+    if(opts.profileSample) instrument_sampling(main);
     // BasicBlock *AfterBB = Builder.GetInsertBlock()->getParent();
     // Builder.SetInsertPoint(AfterBB);
 
-    TheModule->print(outs(), nullptr);
+    // Profile guided optimization works on whole modules, so it has to run
+    // before the IR is printed.
+    if(opts.profileGenerate || !opts.profileUse.empty()){
+      legacy::PassManager PGO;
+      if(opts.profileGenerate){
+        PGO.add(createPGOInstrumentationGenLegacyPass());
+        PGO.add(createInstrProfilingLegacyPass());
+      }
+      else{
+        // Attaches branch weights and entry counts, the inliner then uses
+        // the profile summary to favour hot call sites.
+        PGO.add(createPGOInstrumentationUseLegacyPass(opts.profileUse));
+        PGO.add(createFunctionInliningPass());
+        PGO.add(createCFGSimplificationPass());
+      }
+      PGO.run(*TheModule);
+    }
+  }
 
+  // Verifies TheModule, optimizes its routines and prints it, so the .ll
+  // has what the object file would. The module is the one llvm_compile
+  // built or the one the compile cache kept of it.
+  static void llvm_dump(raw_ostream &out) {
     // Verify the IR.
     bool bad = verifyModule(*TheModule, &errs());
     if (bad) {
-      std::cerr << "The IR is bad!" << std::endl;
-      std::exit(1);
+      diag() << "The IR is bad!" << std::endl;
+      compile_error();
+    }
+
+    TheFPM = make_unique<legacy::FunctionPassManager>(TheModule.get());
+    TheFPM->add(createPromoteMemoryToRegisterPass());
+    TheFPM->add(createInstructionCombiningPass());
+    TheFPM->add(createReassociatePass());
+    TheFPM->add(createGVNPass());
+    TheFPM->add(createCFGSimplificationPass());
+    // Ranges of the operands prove many overflow checks cannot fail.
+    if(opts.checkOverflow) TheFPM->add(createCorrelatedValuePropagationPass());
+    TheFPM->doInitialization();
+    // The checks are in every routine, so is their removal.
+    for (Function &F : *TheModule) {
+      if(!F.isDeclaration()) TheFPM->run(F);
     }
-    TheFPM->run(*main);
-    // Print out the IR.
-    // TheModule->print(outs(), nullptr);
+    TheFPM->doFinalization();
+
+    TheModule->print(out, nullptr);
   }
 
+private:
+  bool fingerprinted = false;
+  uint64_t fingerprintValue = 0;
 };
+
+inline void *AST::operator new(size_t size) {
+  const size_t header = alignof(std::max_align_t);
+  char *raw = static_cast<char *>(::operator new(header + size));
+  AstArena *arena = AstArena::current;
+  *reinterpret_cast<AstArena **>(raw) = arena;
+  AST *node = reinterpret_cast<AST *>(raw + header);
+  if (arena) {
+    arena->order.push_back(node);
+    arena->live.insert(node);
+  }
+  return node;
+}
+
+inline void AST::operator delete(void *p) {
+  if (!p) return;
+  char *raw = static_cast<char *>(p) - alignof(std::max_align_t);
+  if (AstArena *arena = *reinterpret_cast<AstArena **>(raw)) arena->live.erase(static_cast<AST *>(p));
+  ::operator delete(raw);
+}
+
+inline AstArena::~AstArena() {
+  for (AST *node : order) {
+    if (live.count(node)) delete node;
+  }
+}
@@ -11,9 +11,20 @@ public:
   virtual bool operator==(const OurType &that) const { return false; }
   virtual Value* compile() const override { return 0;}
   virtual Value* compile_r() const override { return 0;}
+  // Same kind, size and element type, unlike == which also lets nil and
+  // strings through.
+  virtual bool sameAs(AST *that) override {
+    OurType *t = dynamic_cast<OurType *>(that);
+    if(!t || t->val != val || t->size != size) return false;
+    return sameNode(oftype, t->oftype);
+  }
   Types val;
   OurType *oftype;
   int size;
+protected:
+  virtual uint64_t computeFingerprint() override {
+    return mix(mix(val, size), fingerprintOf(oftype));
+  }
 };
 
 class TypeNil: public OurType{
@@ -58,8 +69,8 @@ public:
     return s;
   }
   virtual bool operator==(const OurType &that) const override {
-    std::cout << "Variable result is used uninitialized";
-    exit(1);
+    diag() << "Variable result is used uninitialized";
+    compile_error();
   }
   virtual Value* compile() const override { return 0;}
   virtual Value* compile_r() const override { return 0;}
@@ -278,6 +289,10 @@ public:
       return true;
     }
     if(that.val == TYPE_POINTER){
+      // Only new [n] makes the objects of pointers to arrays of unknown
+      // size, they carry their length.
+      if(oftype->val == TYPE_ARRAY && that.oftype->val == TYPE_ARRAY &&
+         (oftype->size > 0) != (that.oftype->size > 0)) return false;
       if(*oftype == *that.oftype) return true;
     }
     return false;
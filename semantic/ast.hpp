@@ -1,12 +1,18 @@
 #include "../error.h"
 #include "../lexer/lexer.hpp"
 #include "symbol.hpp"
+#include "ssa.hpp"
+#include "checks.hpp"
+#include "strings.hpp"
 #include <cstring>
 #include <iostream>
 #include <vector>
 
+#include <llvm/Config/llvm-config.h>
 #include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Intrinsics.h>
 #include <llvm/IR/LegacyPassManager.h>
+#include <llvm/IR/MDBuilder.h>
 #include <llvm/IR/Module.h>
 #include <llvm/IR/Value.h>
 #include <llvm/IR/Verifier.h>
@@ -35,13 +41,95 @@ inline std::ostream& operator<<(std::ostream &out, Types t) {
 
 
 
-extern std::vector<int> rt_stack;
+extern thread_local std::vector<int> rt_stack;
 
 inline std::ostream& operator<<(std::ostream &out, const AST &t) {
   t.printOn(out);
   return out;
 }
 
+// Scalars whose address never escapes live in SSA registers (ssa.hpp), the
+// rest get a stack slot.
+inline bool inRegister(SymbolEntry *e, OurType *t) {
+  if (e->addressTaken || !t) return false;
+  return t->val == TYPE_INTEGER || t->val == TYPE_REAL || t->val == TYPE_BOOLEAN;
+}
+
+// Type based alias analysis: every PCL scalar type is a node under one root,
+// so a store of one type never changes a value of another. The nodes are
+// uniqued by the context, building them again is cheap.
+inline MDNode *tbaaTag(OurType *t) {
+  const char *name;
+  switch (t ? t->val : TYPE_NIL) {
+  case TYPE_INTEGER: name = "integer"; break;
+  case TYPE_REAL: name = "real"; break;
+  case TYPE_BOOLEAN: name = "boolean"; break;
+  case TYPE_CHAR: name = "char"; break;
+  case TYPE_POINTER: name = "pointer"; break;
+  default: return nullptr;
+  }
+  MDBuilder mdb(AST::TheContext);
+  MDNode *scalar = mdb.createTBAAScalarTypeNode(name, mdb.createTBAARoot("PCL types"));
+  return mdb.createTBAAStructTagNode(scalar, scalar, 0);
+}
+
+template <typename Access>
+inline Access *withTBAA(Access *i, OurType *t) {
+  if (MDNode *tag = tbaaTag(t)) i->setMetadata(LLVMContext::MD_tbaa, tag);
+  return i;
+}
+
+// How values of a PCL type are kept in memory. A pointer points to its
+// object, or to the first element when the object is an array of unknown
+// size (new [n] p). Characters take a byte, as in string literals.
+inline llvm::Type *storageType(OurType *t);
+inline llvm::Type *objectType(OurType *t) {
+  if (t->val == TYPE_ARRAY && t->size <= 0) return storageType(t->oftype);
+  return storageType(t);
+}
+inline llvm::Type *storageType(OurType *t) {
+  switch (t->val) {
+  case TYPE_INTEGER: return AST::i32;
+  case TYPE_REAL: return AST::DoubleTyID;
+  case TYPE_BOOLEAN: return AST::i1;
+  case TYPE_CHAR: return AST::i8;
+  case TYPE_POINTER: return PointerType::get(objectType(t->oftype), 0);
+  case TYPE_ARRAY:
+    if (t->size > 0) return ArrayType::get(storageType(t->oftype), t->size);
+    return AST::i32;
+  default: return AST::i32;
+  }
+}
+
+// The value of type t at p. Characters are computed with as i32.
+inline Value *loadObject(Value *p, OurType *t) {
+  Value *v = withTBAA(AST::Builder.CreateLoad(storageType(t), p), t);
+  if (t->val == TYPE_CHAR) v = AST::Builder.CreateZExt(v, AST::i32);
+  return v;
+}
+
+// Copies count (an i32) elements of type element from src to dst.
+inline void copyElements(Value *dst, Value *src, Value *count, llvm::Type *element) {
+  IRBuilder<> &B = AST::Builder;
+  Value *bytes = B.CreateMul(B.CreateZExt(count, AST::i64), ConstantExpr::getSizeOf(element), "bytes");
+#if LLVM_VERSION_MAJOR >= 10
+  B.CreateMemCpy(dst, MaybeAlign(), src, MaybeAlign(), bytes);
+#elif LLVM_VERSION_MAJOR >= 7
+  B.CreateMemCpy(dst, 1, src, 1, bytes);
+#else
+  B.CreateMemCpy(dst, src, bytes, 1);
+#endif
+}
+
+// new [n] p with p a pointer to an array of unknown size puts n, an i32, just
+// in front of the elements p points to; objectHeader bytes keep them aligned.
+const unsigned objectHeader = 8;
+inline bool isOpenArray(OurType *t) { return t->val == TYPE_ARRAY && t->size <= 0; }
+inline Value *elementCount(Value *object) {
+  Value *count = AST::Builder.CreatePointerCast(object, PointerType::get(AST::i32, 0));
+  return AST::Builder.CreateConstGEP1_32(AST::i32, count, -1, "count");
+}
+
 class Expr: public AST {
 public:
   virtual int eval() const = 0;
@@ -61,6 +149,34 @@ public:
   virtual bool isResult(){
       return false;
   }
+  // p^, the object of a pointer.
+  virtual bool isDereference() const { return false; }
+  // The variable this expression names if it lives in registers, an
+  // assignment to it defines a new SSA value instead of storing.
+  virtual SymbolEntry *ssaVariable() const { return nullptr; }
+  // The expression's address escapes (@, by reference arguments).
+  virtual void markAddressTaken() {}
+  // The variable an l-value stores into, nullptr when it is not known.
+  virtual SymbolEntry *target() const { return nullptr; }
+  // An assignment stores into the expression.
+  virtual void markWritten() {
+    if(SymbolEntry *t = target()) t->written = true;
+  }
+  // The value of an integer constant, for sizes known at compile time.
+  virtual bool constantValue(int &value) const { return false; }
+  // Of an array: its first element and how many elements it has (i32), 0
+  // when that is not known (the object of new [n] p). Routines take their
+  // array arguments as these two.
+  virtual Value *arrayBase() const {
+    Value *a = compile();
+    if(!a || type->size <= 0) return a;
+    return Builder.CreateConstInBoundsGEP2_32(storageType(type), a, 0, 0);
+  }
+  virtual Value *arrayLength() const {
+    return c32(type->size > 0 ? type->size : 0);
+  }
+  // Of the operator, for run time errors.
+  int line = 0;
   // virtual Value* compile() const override { return nullptr;}
 
   bool isNew;
@@ -69,9 +185,6 @@ public:
 class Expr_list: public AST{
 public:
   Expr_list(): expr_list(){}
-  ~Expr_list() {
-    for (Expr *e : expr_list) delete e;
-  }
   void append_expr(Expr *e) { expr_list.push_back(e); }
   void append_begin(Expr *e) { expr_list.insert(expr_list.begin(), e); }
   virtual void printOn(std::ostream &out) const override {
@@ -96,7 +209,7 @@ public:
     s += ")";
     return s;
   }
-  std::vector<Expr *> getList(){
+  const std::vector<Expr *> &getList() const {
     return expr_list;
   }
   virtual void sem() override{
@@ -114,7 +227,7 @@ private:
 class Rval: public Expr {
 public:
   virtual int eval() const override {
-    std::cout << "Evaluating Rval";
+    diag() << "Evaluating Rval";
     return -1;
   }
   // virtual Value* compile() const override {  return nullptr;}
@@ -123,7 +236,7 @@ public:
 class Lval: public Expr {
 public:
   virtual int eval() const override {
-    std::cout << "Evaluating Lval";
+    diag() << "Evaluating Lval";
     return -1;
   }
   // virtual Value* compile() const override { return nullptr;}
@@ -151,20 +264,39 @@ public:
   virtual bool isResult() override{
       return true;
   }
-  virtual void sem() override{  }
-  virtual Value* compile() const override { return nullptr;}
-  virtual Value* compile_r() const override { return nullptr;}
+  virtual void sem() override{
+    // The first assignment to result declares it, see Assign::sem.
+    if(st.existsResult()) entry = st.lookup(var);
+  }
+  virtual SymbolEntry *ssaVariable() const override {
+    return entry && entry->ssaType ? entry : nullptr;
+  }
+  virtual void markAddressTaken() override {
+    if(entry) entry->addressTaken = true;
+  }
+  virtual SymbolEntry *target() const override { return entry; }
+  virtual Value* compile() const override { return entry->val;}
+  virtual Value* compile_r() const override {
+    if(entry->ssaType) return TheSSA.read(entry, Builder.GetInsertBlock());
+    llvm::Type *retTy = Builder.GetInsertBlock()->getParent()->getReturnType();
+    return withTBAA(Builder.CreateLoad(retTy, entry->val, var), entry->type);
+  }
 
+  virtual bool sameAs(AST *that) override {
+    return dynamic_cast<Result *>(that) != nullptr;
+  }
+protected:
+  virtual uint64_t computeFingerprint() override { return mix(2, 0); }
 private:
   std::string var;
   int offset;
+  SymbolEntry *entry = nullptr;
 };
 
 class BinOp: public Rval {
 public:
   BinOp(Expr *l, const char *o, Expr *r): left(l), op(o), right(r) {
    }
-  ~BinOp() { delete left; delete right; }
   virtual void printOn(std::ostream &out) const override {
     out << "BinOp(";
     left->printOn(out);
@@ -188,6 +320,11 @@ public:
   virtual bool check_float(Expr *left, Expr *right){
     return (left->type->val == TYPE_REAL) && (right->type->val == TYPE_REAL);
   }
+  // Integers, characters (i32 both) and booleans compare as integers.
+  bool compare_ordinal() const {
+    int t = left->type->val;
+    return t == right->type->val && (t == TYPE_INTEGER || t == TYPE_CHAR || t == TYPE_BOOLEAN);
+  }
   virtual void sem() override {
     left->sem();
     right->sem();
@@ -207,7 +344,7 @@ public:
         type = new Real();
       }
       else{
-        ERROR("Type mismatch!\n"); std::cout << left->type->val << op << right->type->val << "\n"; printOn(std::cout); exit(1);
+        ERROR("Type mismatch!\n"); diag() << left->type->val << op << right->type->val << "\n"; printOn(diag()); compile_error();
       }
     }
     if(! strcmp(op, "/")){
@@ -215,7 +352,7 @@ public:
         type = new Real();
       }
       else{
-        ERROR("Type mismatch!\n"); std::cout << left->type->val << op << right->type->val << "\n"; printOn(std::cout); exit(1);
+        ERROR("Type mismatch!\n"); diag() << left->type->val << op << right->type->val << "\n"; printOn(diag()); compile_error();
       }
     }
     if(! strcmp(op, "mod") || ! strcmp(op, "div")){
@@ -223,20 +360,20 @@ public:
         type = new Integer();
       }
       else{
-        ERROR("Type mismatch!\n"); std::cout << left->type->val << op << right->type->val << "\n"; printOn(std::cout); exit(1);
+        ERROR("Type mismatch!\n"); diag() << left->type->val << op << right->type->val << "\n"; printOn(diag()); compile_error();
       }
     }
     if(! strcmp(op, "=") || ! strcmp(op, "<>")){
       if(!(*left->type == *right->type)){
-        std::cout << "Type missmatch in comparison!\n";
-        printOn(std::cout);
-        exit(1);
+        diag() << "Type missmatch in comparison!\n";
+        printOn(diag());
+        compile_error();
       }
       if(check_number(left, right) || ((left->type->val == right->type->val) && (left->type->val != TYPE_ARRAY)) || (left->type->val == TYPE_NIL || right->type->val == TYPE_NIL)){
         type = new Boolean();
       }
       else{
-        ERROR("Type mismatch!\n"); std::cout << left->type->val << op << right->type->val << "\n"; printOn(std::cout); exit(1);
+        ERROR("Type mismatch!\n"); diag() << left->type->val << op << right->type->val << "\n"; printOn(diag()); compile_error();
       }
     }
     if(! strcmp(op, "<") || ! strcmp(op, ">") || ! strcmp(op, "<=") || ! strcmp(op, ">=")){
@@ -244,7 +381,7 @@ public:
         type = new Boolean();
       }
       else{
-        ERROR("Type mismatch!\n"); std::cout << left->type->val << op << right->type->val << "\n"; printOn(std::cout); exit(1);
+        ERROR("Type mismatch!\n"); diag() << left->type->val << op << right->type->val << "\n"; printOn(diag()); compile_error();
       }
     }
     if(! strcmp(op, "or") || ! strcmp(op, "and")){
@@ -252,7 +389,7 @@ public:
         type = new Boolean();
       }
       else{
-        ERROR("Type mismatch!\n"); std::cout << left->type->val << op << right->type->val << "\n"; printOn(std::cout); exit(1);
+        ERROR("Type mismatch!\n"); diag() << left->type->val << op << right->type->val << "\n"; printOn(diag()); compile_error();
       }
     }
   }
@@ -274,22 +411,25 @@ public:
     return 0;  // this will never be reached.
   }
   virtual Value* compile() const override {
-    // printOn(std::cout);
+    // printOn(diag());
     Value *l = left->compile_r();
     // l = Builder.CreateLoad(l);
     Value *r = right->compile_r();
     if(! strcmp(op, "+")){
       if((left->type->val == TYPE_REAL) && (right->type->val == TYPE_REAL)) return Builder.CreateFAdd(l, r, "faddtmp");
-      return Builder.CreateAdd(l, r, "addtmp");
+      if(opts.checkOverflow) return TheChecks.add(l, r, line);
+      return Builder.CreateNSWAdd(l, r, "addtmp");
     }
 
     if(! strcmp(op, "-")){
       if((left->type->val == TYPE_REAL) && (right->type->val == TYPE_REAL)) return Builder.CreateFSub(l, r, "fsubtmp");
-      return Builder.CreateSub(l, r, "subtmp");
+      if(opts.checkOverflow) return TheChecks.sub(l, r, line);
+      return Builder.CreateNSWSub(l, r, "subtmp");
     }
     if(! strcmp(op, "*")){
       if((left->type->val == TYPE_REAL) && (right->type->val == TYPE_REAL)) return Builder.CreateFMul(l, r, "fmultmp");
-      return Builder.CreateMul(l, r, "multmp");
+      if(opts.checkOverflow) return TheChecks.mul(l, r, line);
+      return Builder.CreateNSWMul(l, r, "multmp");
     }
     if(! strcmp(op, "/")) return Builder.CreateFDiv(l, r, "fdivtmp"); //must be float?
     if(! strcmp(op, "=")){
@@ -297,7 +437,7 @@ public:
 
           return Builder.CreateFCmpOEQ(l, r, "feqtmp"); // OEQ means ordered eq e.g. expects both operants to be numbers (not NaN)
       }
-      else if(left->type->val == TYPE_INTEGER && right->type->val == TYPE_INTEGER){
+      else if(compare_ordinal()){
         Value *v = Builder.CreateICmpEQ(l, r, "eqtmp");
         v->print(errs());
         return Builder.CreateICmpEQ(l, r, "eqtmp");
@@ -307,7 +447,7 @@ public:
       if(left->type->val == TYPE_REAL && right->type->val == TYPE_REAL){
           return Builder.CreateFCmpOLT(l, r, "flttmp"); // OEQ means ordered eq e.g. expects both operants to be numbers (not NaN)
       }
-      else if(left->type->val == TYPE_INTEGER && right->type->val == TYPE_INTEGER){
+      else if(compare_ordinal()){
         return Builder.CreateICmpSLT(l, r, "lttmp"); // signed less than
       }
     }
@@ -315,7 +455,7 @@ public:
       if(left->type->val == TYPE_REAL && right->type->val == TYPE_REAL){
           return Builder.CreateFCmpOGT(l, r, "fgttmp"); // OEQ means ordered eq e.g. expects both operants to be numbers (not NaN)
       }
-      else if(left->type->val == TYPE_INTEGER && right->type->val == TYPE_INTEGER){
+      else if(compare_ordinal()){
         return Builder.CreateICmpSGT(l, r, "lgtmp"); // signed greater than
       }
     }
@@ -323,7 +463,7 @@ public:
       if(left->type->val == TYPE_REAL && right->type->val == TYPE_REAL){
           return Builder.CreateFCmpOLE(l, r, "fletmp"); // OEQ means ordered eq e.g. expects both operants to be numbers (not NaN)
       }
-      else if(left->type->val == TYPE_INTEGER && right->type->val == TYPE_INTEGER){
+      else if(compare_ordinal()){
         return Builder.CreateICmpSLE(l, r, "lletmp"); // signed less eq than
       }
     }
@@ -331,7 +471,7 @@ public:
       if(left->type->val == TYPE_REAL && right->type->val == TYPE_REAL){
           return Builder.CreateFCmpOGE(l, r, "fgetmp"); // OEQ means ordered eq e.g. expects both operants to be numbers (not NaN)
       }
-      else if(left->type->val == TYPE_INTEGER && right->type->val == TYPE_INTEGER){
+      else if(compare_ordinal()){
         return Builder.CreateICmpSGE(l, r, "lgetmp"); // signed greater eq than
       }
     }
@@ -339,40 +479,49 @@ public:
       if(left->type->val == TYPE_REAL && right->type->val == TYPE_REAL){
           return Builder.CreateFCmpONE(l, r, "fnetmp"); // OEQ means ordered eq e.g. expects both operants to be numbers (not NaN)
       }
-      else if(left->type->val == TYPE_INTEGER && right->type->val == TYPE_INTEGER){
+      else if(compare_ordinal()){
         return Builder.CreateICmpNE(l, r, "lnetmp"); // not equal
       }
     }
-    if(! strcmp(op, "div")) return Builder.CreateSDiv(l, r, "divtmp");
-    if(! strcmp(op, "mod")) return Builder.CreateSRem(l, r, "modtmp");
+    if(! strcmp(op, "div")){
+      if(opts.checkOverflow) return TheChecks.divide(l, r, false, line);
+      return Builder.CreateSDiv(l, r, "divtmp");
+    }
+    if(! strcmp(op, "mod")){
+      if(opts.checkOverflow) return TheChecks.divide(l, r, true, line);
+      return Builder.CreateSRem(l, r, "modtmp");
+    }
     if(! strcmp(op, "or")) return Builder.CreateOr(l, r, "ortmp");
     if(! strcmp(op, "and")) return Builder.CreateAnd(l, r, "andtmp");
     return nullptr;
   }
   virtual Value* compile_r() const override {
-    // printOn(std::cout);
+    // printOn(diag());
     Value *l = left->compile_r();
     // l = Builder.CreateLoad(l);
     Value *r = right->compile_r();
 
     if(! strcmp(op, "+")){
       if((left->type->val == TYPE_REAL) && (right->type->val == TYPE_REAL)) return Builder.CreateFAdd(l, r, "faddtmp");
-      return Builder.CreateAdd(l, r, "addtmp");
+      if(opts.checkOverflow) return TheChecks.add(l, r, line);
+      return Builder.CreateNSWAdd(l, r, "addtmp");
     }
     if(! strcmp(op, "-")){
       if((left->type->val == TYPE_REAL) && (right->type->val == TYPE_REAL)) return Builder.CreateFSub(l, r, "fsubtmp");
-      return Builder.CreateSub(l, r, "subtmp");
+      if(opts.checkOverflow) return TheChecks.sub(l, r, line);
+      return Builder.CreateNSWSub(l, r, "subtmp");
     }
     if(! strcmp(op, "*")){
       if((left->type->val == TYPE_REAL) && (right->type->val == TYPE_REAL)) return Builder.CreateFMul(l, r, "fmultmp");
-      return Builder.CreateMul(l, r, "multmp");
+      if(opts.checkOverflow) return TheChecks.mul(l, r, line);
+      return Builder.CreateNSWMul(l, r, "multmp");
     }
     if(! strcmp(op, "/")) return Builder.CreateFDiv(l, r, "fdivtmp"); //must be float?
     if(! strcmp(op, "=")){
       if(left->type->val == TYPE_REAL && right->type->val == TYPE_REAL){
           return Builder.CreateFCmpOEQ(l, r, "feqtmp"); // OEQ means ordered eq e.g. expects both operants to be numbers (not NaN)
       }
-      else if(left->type->val == TYPE_INTEGER && right->type->val == TYPE_INTEGER){
+      else if(compare_ordinal()){
         return Builder.CreateICmpEQ(l, r, "eqtmp");
       }
     }
@@ -380,7 +529,7 @@ public:
       if(left->type->val == TYPE_REAL && right->type->val == TYPE_REAL){
           return Builder.CreateFCmpOLT(l, r, "flttmp"); // OEQ means ordered eq e.g. expects both operants to be numbers (not NaN)
       }
-      else if(left->type->val == TYPE_INTEGER && right->type->val == TYPE_INTEGER){
+      else if(compare_ordinal()){
         return Builder.CreateICmpSLT(l, r, "lttmp"); // signed less than
       }
     }
@@ -388,7 +537,7 @@ public:
       if(left->type->val == TYPE_REAL && right->type->val == TYPE_REAL){
           return Builder.CreateFCmpOGT(l, r, "fgttmp"); // OEQ means ordered eq e.g. expects both operants to be numbers (not NaN)
       }
-      else if(left->type->val == TYPE_INTEGER && right->type->val == TYPE_INTEGER){
+      else if(compare_ordinal()){
         return Builder.CreateICmpSGT(l, r, "lgtmp"); // signed greater than
       }
     }
@@ -396,7 +545,7 @@ public:
       if(left->type->val == TYPE_REAL && right->type->val == TYPE_REAL){
           return Builder.CreateFCmpOLE(l, r, "fletmp"); // OEQ means ordered eq e.g. expects both operants to be numbers (not NaN)
       }
-      else if(left->type->val == TYPE_INTEGER && right->type->val == TYPE_INTEGER){
+      else if(compare_ordinal()){
         return Builder.CreateICmpSLE(l, r, "lletmp"); // signed less eq than
       }
     }
@@ -404,7 +553,7 @@ public:
       if(left->type->val == TYPE_REAL && right->type->val == TYPE_REAL){
           return Builder.CreateFCmpOGE(l, r, "fgetmp"); // OEQ means ordered eq e.g. expects both operants to be numbers (not NaN)
       }
-      else if(left->type->val == TYPE_INTEGER && right->type->val == TYPE_INTEGER){
+      else if(compare_ordinal()){
         return Builder.CreateICmpSGE(l, r, "lgetmp"); // signed greater eq than
       }
     }
@@ -412,12 +561,18 @@ public:
       if(left->type->val == TYPE_REAL && right->type->val == TYPE_REAL){
           return Builder.CreateFCmpONE(l, r, "fnetmp"); // OEQ means ordered eq e.g. expects both operants to be numbers (not NaN)
       }
-      else if(left->type->val == TYPE_INTEGER && right->type->val == TYPE_INTEGER){
+      else if(compare_ordinal()){
         return Builder.CreateICmpNE(l, r, "lnetmp"); // not equal
       }
     }
-    if(! strcmp(op, "div")) return Builder.CreateSDiv(l, r, "divtmp");
-    if(! strcmp(op, "mod")) return Builder.CreateSRem(l, r, "modtmp");
+    if(! strcmp(op, "div")){
+      if(opts.checkOverflow) return TheChecks.divide(l, r, false, line);
+      return Builder.CreateSDiv(l, r, "divtmp");
+    }
+    if(! strcmp(op, "mod")){
+      if(opts.checkOverflow) return TheChecks.divide(l, r, true, line);
+      return Builder.CreateSRem(l, r, "modtmp");
+    }
     if(! strcmp(op, "or")) return Builder.CreateOr(l, r, "ortmp");
     if(! strcmp(op, "and")) return Builder.CreateAnd(l, r, "andtmp");
     return nullptr;
@@ -433,7 +588,6 @@ private:
 class UnOp: public Rval {
 public:
   UnOp(const char *o, Expr *r): op(o), right(r) {}
-  ~UnOp() { delete right; }
   virtual void printOn(std::ostream &out) const override {
     out << "UnOp(";
     if(op) out << op;
@@ -458,7 +612,7 @@ public:
         type = right->type;
       }
       else{
-        ERROR("Type mismatch!\n"); std::cout << op << right->type->val << "\n"; exit(1);
+        ERROR("Type mismatch!\n"); diag() << op << right->type->val << "\n"; compile_error();
       }
     }
     if( ! strcmp(op, "not")){
@@ -466,7 +620,7 @@ public:
         type = new Boolean();
       }
       else{
-        ERROR("Type mismatch!\n"); std::cout << op << right->type->val << "\n"; exit(1);
+        ERROR("Type mismatch!\n"); diag() << op << right->type->val << "\n"; compile_error();
       }
     }
   }
@@ -476,14 +630,40 @@ public:
     if(! strcmp(op, "not")) return !right->eval();
     return 0;  // this will never be reached.
   }
-  virtual Value* compile() const override { return nullptr;}
-  virtual Value* compile_r() const override { return nullptr;}
+  virtual Value* compile() const override {
+    Value *v = right->compile_r();
+    if(! strcmp(op, "not")) return Builder.CreateNot(v, "nottmp");
+    if(! strcmp(op, "-")){
+      if(type->val == TYPE_REAL) return Builder.CreateFNeg(v, "fnegtmp");
+      Value *zero = ConstantInt::get(v->getType(), 0);
+      if(opts.checkOverflow) return TheChecks.sub(zero, v, line);
+      return Builder.CreateNSWSub(zero, v, "negtmp");
+    }
+    return v;
+  }
+  virtual Value* compile_r() const override { return compile(); }
 
 private:
   const char *op;
   Expr *right;
 };
 
+// Array formals are passed as their first element and length.
+inline bool isArrayFormal(SymbolEntry *e){
+  return e->type && e->type->val == TYPE_ARRAY && !e->local;
+}
+// Variable e in the function being generated: where its routine keeps it,
+// or the parameters a nested routine received for it. The second value is
+// the length of an array formal, nullptr for anything else.
+inline std::pair<Value *, Value *> variableHere(SymbolEntry *e){
+  if(!e->capturedIn.empty()){
+    auto it = e->capturedIn.find(AST::Builder.GetInsertBlock()->getParent());
+    if(it != e->capturedIn.end()) return it->second;
+  }
+  if(e->length) return std::make_pair(e->v, e->length);
+  return std::make_pair(e->val, (Value *) nullptr);
+}
+
 class Id: public Lval {
 public:
   Id(char* v): var(v), offset(-1){   }
@@ -503,20 +683,42 @@ public:
     return rt_stack[offset];
   }
   virtual void sem() override {
-    std::string s = var;
-    type = st.lookup(s)->type;
-    SymbolEntry *en = st.lookup(var);
-    offset = en->offset;
-  }
+    entry = st.lookup(var);
+    type = entry->type;
+    offset = entry->offset;
+    // A nested routine reaches it through memory, its address is passed in.
+    if(entry->owner != st.routine){
+      entry->addressTaken = true;
+      st.capture(entry);
+      st.noteShared();
+    }
+    if(entry->owner != st.routine || entry->byRef) st.noteRead();
+    if(type && type->val == TYPE_POINTER) entry->pointerUses++;
+  }
+  virtual SymbolEntry *ssaVariable() const override {
+    return entry->ssaType ? entry : nullptr;
+  }
+  virtual void markAddressTaken() override {
+    entry->addressTaken = true;
+  }
+  virtual SymbolEntry *target() const override { return entry; }
+  // An array formal is its first element.
   virtual Value* compile() const override {
-    std::string s = var;
-    AllocaInst *Alloca = st.lookup(s)->val;
-    return Alloca;
+    return variableHere(entry).first;
+  }
+  virtual Value *arrayLength() const override {
+    if(Value *length = variableHere(entry).second) return length;
+    return Lval::arrayLength();
+  }
+  virtual Value *arrayBase() const override {
+    std::pair<Value *, Value *> here = variableHere(entry);
+    if(here.second) return here.first;
+    return Lval::arrayBase();
   }
   virtual Value* compile_r() const override {
-    std::string s = var;
-    Value *V = st.lookup(s)->val;
-    Value *ret = Builder.CreateLoad(V, s);
+    if(entry->ssaType) return TheSSA.read(entry, Builder.GetInsertBlock());
+    Value *ret = withTBAA(Builder.CreateLoad(storageType(entry->type), variableHere(entry).first, var), entry->type);
+    if(type->val == TYPE_CHAR) ret = Builder.CreateZExt(ret, i32);
     //This is for testing only
     // Value *n64 = Builder.CreateFPExt(ret, DoubleTyID, "ext");
     // Builder.CreateCall(TheWriteReal, std::vector<Value *> { n64 });
@@ -526,12 +728,25 @@ public:
     return ret;
   }
 
+  virtual bool sameAs(AST *that) override {
+    Id *t = dynamic_cast<Id *>(that);
+    return t && strcmp(var, t->var) == 0;
+  }
+protected:
+  virtual uint64_t computeFingerprint() override { return mix(1, hashString(var)); }
 private:
   char* var;
   int offset;
-
+  SymbolEntry *entry = nullptr;
 };
 
+// e, if it is a pointer variable, is used only to reach its object there.
+inline void objectUse(Expr *e){
+  Id *id = dynamic_cast<Id *>(e);
+  SymbolEntry *v = id ? id->target() : nullptr;
+  if(v && v->type->val == TYPE_POINTER) v->objectUses++;
+}
+
 class ArrayItem: public Lval {
 public:
   ArrayItem(Expr *l, Expr *e){
@@ -553,7 +768,7 @@ public:
     return s;
   }
   virtual int eval() const override {
-    std::cout << "Evaluating ArrayItem";
+    diag() << "Evaluating ArrayItem";
     return -1;
   }
   virtual void sem() override {
@@ -566,21 +781,44 @@ public:
       expr->type = st.lookup("result")->type;
     }
     if(lval->type->val != TYPE_ARRAY){
-      std::cout << "\n is not of type array!\n";
-      exit(1);
+      diag() << "\n is not of type array!\n";
+      compile_error();
     }
     else{
       if(expr->type->val != TYPE_INTEGER){
-        std::cout<<lval->type->val;
-        std::cout << "\nbracket expression is not of type integer!\n";
-        exit(1);
+        diag()<<lval->type->val;
+        diag() << "\nbracket expression is not of type integer!\n";
+        compile_error();
       }
     }
     type = lval->type->oftype;
+    // Array formals are the caller's memory.
+    SymbolEntry *t = lval->target();
+    if(!t || t->owner != st.routine || !t->local) st.noteRead();
+  }
+  virtual void markAddressTaken() override { lval->markAddressTaken(); }
+  virtual void markWritten() override { lval->markWritten(); }
+  virtual SymbolEntry *target() const override { return lval->target(); }
+  virtual Value* compile() const override {
+    Value *base = lval->arrayBase();
+    Value *i = expr->compile_r();
+    if(!base || !i) return nullptr;
+    return Builder.CreateInBoundsGEP(storageType(type), base, Builder.CreateSExt(i, i64), "item");
+  }
+  virtual Value* compile_r() const override {
+    Value *p = compile();
+    if(!p) return nullptr;
+    return loadObject(p, type);
   }
-  virtual Value* compile() const override { return nullptr;}
-  virtual Value* compile_r() const override { return nullptr;}
 
+  virtual bool sameAs(AST *that) override {
+    ArrayItem *t = dynamic_cast<ArrayItem *>(that);
+    return t && sameNode(lval, t->lval) && sameNode(expr, t->expr);
+  }
+protected:
+  virtual uint64_t computeFingerprint() override {
+    return mix(mix(3, fingerprintOf(lval)), fingerprintOf(expr));
+  }
 private:
   Expr *lval;
   Expr *expr;
@@ -604,18 +842,26 @@ public:
     return s;
   }
   virtual int eval() const override {
-    std::cout << "Evaluating Reference";
+    diag() << "Evaluating Reference";
     return -1;
   }
   virtual void sem() override{
       lval->sem();
+      lval->markAddressTaken();
       if(lval->type->val == TYPE_RES){
         lval->type = st.lookup("result")->type;
       }
+      // Only the objects of new [n] keep their length.
+      if(isOpenArray(lval->type) && !lval->isDereference()){
+        printOn(diag());
+        diag() << "\nCan not take the address of an array of unknown size\n";
+        compile_error();
+      }
       type = new Pointer(lval->type);
   }
-  virtual Value* compile() const override { return nullptr;}
-  virtual Value* compile_r() const override { return nullptr;}
+  // The operand is in memory, sem marked its address taken.
+  virtual Value* compile() const override { return lval->compile(); }
+  virtual Value* compile_r() const override { return compile(); }
 
 private:
   Expr *lval;
@@ -639,26 +885,52 @@ public:
     return s;
   }
   virtual int eval() const override {
-    std::cout << "Evaluating Dereference";
+    diag() << "Evaluating Dereference";
     return -1;
   }
   virtual void sem() override{
       expr->sem();
+      objectUse(expr);
+      st.noteRead();
+      st.noteShared();
       if(expr->type->val == TYPE_RES){
         expr->type = st.lookup("result")->type;
       }
       if(!(expr->type->val == TYPE_POINTER)){
-        printOn(std::cout);
-        std::cout << "\n Can only Dereference type pointer!\n";
-        std::cout << "\n expression is of type ";
-        expr->type->printOn(std::cout);
-        exit(1);
+        printOn(diag());
+        diag() << "\n Can only Dereference type pointer!\n";
+        diag() << "\n expression is of type ";
+        expr->type->printOn(diag());
+        compile_error();
       }
       type = expr->type->oftype;
   }
-  virtual Value* compile() const override { return nullptr;}
-  virtual Value* compile_r() const override { return nullptr;}
+  // @p^, or p^ or an element of it passed by reference: the object can be
+  // reached without p, so it may not die with p's frame.
+  virtual void markAddressTaken() override {
+    if(SymbolEntry *p = expr->target()) p->addressTaken = true;
+  }
+  virtual bool isDereference() const override { return true; }
+  // The object's address is the pointer.
+  virtual Value* compile() const override { return expr->compile_r(); }
+  virtual Value *arrayLength() const override {
+    if(!isOpenArray(type)) return Lval::arrayLength();
+    Value *p = compile();
+    if(!p) return nullptr;
+    return Builder.CreateLoad(i32, elementCount(p), "length");
+  }
+  virtual Value* compile_r() const override {
+    Value *p = compile();
+    if(!p) return nullptr;
+    return loadObject(p, type);
+  }
 
+  virtual bool sameAs(AST *that) override {
+    Dereference *t = dynamic_cast<Dereference *>(that);
+    return t && sameNode(expr, t->expr);
+  }
+protected:
+  virtual uint64_t computeFingerprint() override { return mix(4, fingerprintOf(expr)); }
 private:
   Expr *expr;
 };
@@ -669,6 +941,8 @@ private:
 class Stmt: public AST {
 public:
   virtual void run() const = 0;
+  // Where the parser made it, for the errors sem finds in it.
+  int line = 0;
 };
 
 
@@ -699,16 +973,16 @@ public:
     std::string s;
     s = id;
     if(!st.isLabel(s)){
-      printOn(std::cout);
-      std::cout << "\n" << s << " is not a label in this scope!\n";
-      exit(1);
+      printOn(diag());
+      diag() << "\n" << s << " is not a label in this scope!\n";
+      compile_error();
     }
     else{
       st.insertLabelStmt(s, stmt);
     }
   }
   virtual void run() const override {
-    std::cout << "Running IdLabel";
+    diag() << "Running IdLabel";
   }
   virtual Value* compile() const override { return nullptr;}
   virtual Value* compile_r() const override { return nullptr;}
@@ -737,78 +1011,90 @@ public:
     return s;
   }
   virtual void run() const override {
-    std::cout << "Running Assign";
+    diag() << "Running Assign";
   }
   virtual void sem() override{
     std::string funName;
     OurType *funType;
     if(lval && exprRight){
       lval->sem();
+      objectUse(lval);
       exprRight->sem();
+      // Stores outside the routine's own variables are its effects.
+      SymbolEntry *t = lval->target();
+      if(!lval->isResult() && (!t || t->owner != st.routine || t->byRef)) st.noteWrite();
+      lval->markWritten();
       if(lval->isResult()){
         //result
         if(!st.existsResult()){
           st.insert("result", exprRight->type);
+          st.lookup("result")->owner = st.routine;
         }
+        lval->sem();
 
         funName  = st.getParent();
         funType = st.lookup(funName)->type;
         if(funType->val == TYPE_PROCEDURE){
-          std::cout << "Procedure " << funName << " cant return a result!\n";
-          exit(1);
+          diag() << "Procedure " << funName << " cant return a result!\n";
+          compile_error();
         }
         OurType *resultType = exprRight->type;
         if(resultType->val == TYPE_ARRAY){
-          std::cout << "In function " << funName << " , result can not be of type Array\n";
-          exit(1);
+          diag() << "In function " << funName << " , result can not be of type Array\n";
+          compile_error();
 
         }
         if(!(*resultType == *funType)){
-          std::cout << "Function " << funName << " is of type ";
-          funType->printOn(std::cout);
-          std::cout << " but returns type ";
-          resultType->printOn(std::cout);
-          std::cout << "\n";
-          exit(1);
+          diag() << "Function " << funName << " is of type ";
+          funType->printOn(diag());
+          diag() << " but returns type ";
+          resultType->printOn(diag());
+          diag() << "\n";
+          compile_error();
         }
         lval->type = resultType;
       }
       else{
         // not result
         if(!(*lval->type == *exprRight->type)){
-          std::cout << "Assign Type missmatch!\n";
-          printOn(std::cout);
-          std::cout << "\n";
-          lval->type->printOn(std::cout);
-          std::cout << " := ";
-          exprRight->type->printOn(std::cout);
-          std::cout << "\n";
-          exit(1);
+          diag() << "Assign Type missmatch!\n";
+          printOn(diag());
+          diag() << "\n";
+          lval->type->printOn(diag());
+          diag() << " := ";
+          exprRight->type->printOn(diag());
+          diag() << "\n";
+          compile_error();
         }
       }
     }
   }
   virtual Value* compile() const override {
+    if(SymbolEntry *e = lval->ssaVariable()){
+      Value *rhs = exprRight->compile_r();
+      TheSSA.write(e, Builder.GetInsertBlock(), rhs);
+      return rhs;
+    }
+    // Arrays are copied element by element, as many as the target holds.
+    if(lval->type->val == TYPE_ARRAY){
+      Value *dst = lval->arrayBase();
+      Value *src = exprRight->arrayBase();
+      if(!dst || !src) return nullptr;
+      llvm::Type *element = storageType(lval->type->oftype);
+      copyElements(dst, Builder.CreatePointerCast(src, dst->getType()), lval->arrayLength(), element);
+      return nullptr;
+    }
     Value *lhs = lval->compile();
     Value *rhs = exprRight->compile_r();
-    Value *ret;
-    if(lval->isResult()){
-      if(!st.existsResult()){
-        st.insert("result", new TypeRes(), rhs);
-      }
-      ret = rhs;
-    }
-    else{
-      ret = Builder.CreateStore(rhs, lhs);
-    }
-
+    // nil has no object type of its own.
+    if(rhs && lval->type->val == TYPE_POINTER) rhs = Builder.CreatePointerCast(rhs, storageType(lval->type));
+    // A char is kept in a byte, but a function returns it as an i32.
+    if(rhs && lval->type->val == TYPE_CHAR && !lval->isResult()) rhs = Builder.CreateTrunc(rhs, storageType(lval->type));
+    Value *ret = withTBAA(Builder.CreateStore(rhs, lhs), lval->type);
     return ret;
    }
   virtual Value* compile_r() const override {
-    Value *lhs = lval->compile();
-    Value *rhs = exprRight->compile_r();
-    Value * ret = Builder.CreateStore(rhs, lhs);
-    return ret;
+    return compile();
    }
 
 private:
@@ -830,7 +1116,7 @@ public:
     return s;
   }
   virtual void run() const override {
-    std::cout << "Running Return";
+    diag() << "Running Return";
   }
   virtual Value* compile() const override { return nullptr;}
   virtual Value* compile_r() const override { return nullptr;}
@@ -878,18 +1164,32 @@ public:
     s += ")";
     return s;
   }
-  std::vector<char* > getlist(){
+  const std::vector<char* > &getlist() const {
     return id_list;
   }
   int length(){
     return id_list.size();
   }
-  std::vector<char* > charList(){
+  const std::vector<char* > &charList() const {
     return id_list;
   }
   virtual Value* compile() const override { return nullptr;}
   virtual Value* compile_r() const override { return nullptr;}
 
+  virtual bool sameAs(AST *that) override {
+    Id_list *t = dynamic_cast<Id_list *>(that);
+    if(!t || id_list.size() != t->id_list.size()) return false;
+    for (size_t i = 0; i < id_list.size(); i++) {
+      if(strcmp(id_list[i], t->id_list[i]) != 0) return false;
+    }
+    return true;
+  }
+protected:
+  virtual uint64_t computeFingerprint() override {
+    uint64_t h = 6;
+    for (char *id : id_list) h = mix(h, hashString(id));
+    return h;
+  }
 private:
    std::vector<char* > id_list;
 };
@@ -923,36 +1223,53 @@ public:
    }
  }
  virtual void sem() override{
-   // printOn(std::cout);
+   // printOn(diag());
+   entries.clear();
    for (char *id : id_list->getlist()) {
      std::string var = id;
-     // std::cout<<"FORW"<<var;
+     // diag()<<"FORW"<<var;
      if(!st.isForward(var)){
        st.insert(var, type);
      }
+     entries.push_back(st.lookup(var));
+     entries.back()->owner = st.routine;
+     entries.back()->byRef = isRef;
    }
  }
  OurType *getType(){
    return type;
  }
- std::vector<char* > getIdList(){
+ bool isReference() const {
+   return isRef;
+ }
+ // One per id, filled in by sem.
+ const std::vector<SymbolEntry *> &getEntries() const {
+   return entries;
+ }
+ const std::vector<char* > &getIdList() const {
    return id_list->charList();
  }
  virtual Value* compile() const override { return nullptr;}
  virtual Value* compile_r() const override { return nullptr;}
 
+  virtual bool sameAs(AST *that) override {
+    Formal *t = dynamic_cast<Formal *>(that);
+    return t && isRef == t->isRef && sameNode(id_list, t->id_list) && sameNode(type, t->type);
+  }
+protected:
+  virtual uint64_t computeFingerprint() override {
+    return mix(mix(mix(7, isRef), fingerprintOf(id_list)), fingerprintOf(type));
+  }
 private:
   Id_list *id_list;
   OurType *type;
   bool isRef;
+  std::vector<SymbolEntry *> entries;
 };
 
 class Formal_list: public AST{
 public:
   Formal_list(): formal_list(){std::vector<Formal *> formal_list;}
-  ~Formal_list() {
-    for (Formal *f : formal_list) delete f;
-  }
   void append_formal(Formal *f) { formal_list.push_back(f); }
   void append_begin(Formal *f) { formal_list.insert(formal_list.begin(), f); }
 
@@ -982,7 +1299,7 @@ public:
     s += ")";
     return s;
   }
-  std::vector<Formal *> getList(){
+  const std::vector<Formal *> &getList() const {
     return formal_list;
   }
   virtual void semForward() override{
@@ -994,10 +1311,259 @@ public:
   virtual Value* compile() const override { return nullptr;}
   virtual Value* compile_r() const override { return nullptr;}
 
+  // Signatures of forward declarations are matched with this.
+  virtual bool sameAs(AST *that) override {
+    Formal_list *t = dynamic_cast<Formal_list *>(that);
+    if(!t || fingerprint() != t->fingerprint() || formal_list.size() != t->formal_list.size()) return false;
+    for (size_t i = 0; i < formal_list.size(); i++) {
+      if(!formal_list[i]->sameAs(t->formal_list[i])) return false;
+    }
+    return true;
+  }
+protected:
+  virtual uint64_t computeFingerprint() override {
+    uint64_t h = 8;
+    for (Formal *f : formal_list) h = mix(h, f->fingerprint());
+    return h;
+  }
 private:
    std::vector<Formal *> formal_list;
 };
 
+// Checks a call against the callee's formals in one pass over both lists.
+inline void checkCallArguments(const std::string &s, bool isProcedure, Formal_list *formals, Expr_list *actuals){
+  const char *kind = isProcedure ? "procedure" : "function";
+  size_t argumentsExpected = 0;
+  size_t argumentsProvided = actuals ? actuals->getList().size() : 0;
+  if(formals){
+    for (Formal *f : formals->getList()) argumentsExpected += f->getIdList().size();
+  }
+  if(argumentsExpected != argumentsProvided){
+    diag() << "Procedure " << s << " expected " << argumentsExpected << " arguments " << " got " << argumentsProvided;
+    diag() << "\n";
+    compile_error();
+  }
+  if(!argumentsExpected) return;
+  auto actual = actuals->getList().begin();
+  for (Formal *f : formals->getList()) {
+    for (char *id : f->getIdList()) {
+      Expr *e = *actual++;
+      if(f->isReference()) e->markAddressTaken();
+      if(!(*f->getType() == *e->getType())){
+        diag() << "Type mismatch on " << kind << " arguments!\n";
+        diag() << "In " << kind << " "<< s << " arguments:\n";
+        diag() << id;
+        diag() << "\n and \n";
+        e->printOn(diag());
+        diag() << "\nHave different types of ";
+        f->getType()->printOn(diag());
+        diag() << " and ";
+        e->getType()->printOn(diag());
+        diag() << "\n";
+        compile_error();
+      }
+    }
+  }
+}
+
+// How builtin arguments and results are passed to and from the runtime.
+inline llvm::Type *builtinLLVMType(BuiltinType t){
+  switch(t) {
+    case B_VOID: return Type::getVoidTy(AST::TheContext);
+    case B_INTEGER: return AST::i64;
+    case B_BOOLEAN: case B_CHAR: return AST::i8;
+    case B_REAL: return AST::DoubleTyID;
+    case B_STRING: return PointerType::get(AST::i8, 0);
+  }
+  return AST::i32;
+}
+
+// Only the library routines a program calls end up declared in its module,
+// and only those that do input and output (see emitPureBuiltin).
+inline Function *declareBuiltin(const Builtin &b){
+  Function *func = AST::TheModule->getFunction(b.name);
+  if(func) return func;
+  std::vector<llvm::Type *> args;
+  for (unsigned i = 0; i < b.arity; i++) args.push_back(builtinLLVMType(b.params[i].type));
+  func = Function::Create(
+      FunctionType::get(builtinLLVMType(b.result), args, false),
+      Function::ExternalLinkage,
+      b.name,
+      AST::TheModule.get()
+  );
+  func->setDoesNotThrow();
+  // The runtime only reads or fills the string it is given, through that
+  // pointer alone, and keeps no copy of it.
+  for (unsigned i = 0; i < b.arity; i++) {
+    if(b.params[i].type != B_STRING) continue;
+    func->addParamAttr(i, Attribute::NoAlias);
+    func->addParamAttr(i, Attribute::NoCapture);
+    func->addDereferenceableParamAttr(i, 1);
+  }
+  return func;
+}
+
+// void __pcl_write_string_n(i8 *s, i64 length) of runtime/output.c.
+inline Function *declareWriteStringN(){
+  Function *func = AST::TheModule->getFunction("__pcl_write_string_n");
+  if(func) return func;
+  func = Function::Create(
+      FunctionType::get(Type::getVoidTy(AST::TheContext),
+                        std::vector<llvm::Type *> { PointerType::get(AST::i8, 0), AST::i64 }, false),
+      Function::ExternalLinkage, "__pcl_write_string_n", AST::TheModule.get());
+  func->setDoesNotThrow();
+  func->addParamAttr(0, Attribute::NoAlias);
+  func->addParamAttr(0, Attribute::NoCapture);
+  func->addParamAttr(0, Attribute::ReadOnly);
+  return func;
+}
+
+// A libm function of one double, as tan and atan have no intrinsic. It
+// does not touch memory (errno is not looked at), so it may be hoisted and
+// vectorized like the intrinsics.
+inline Function *declareLibm(const char *name){
+  Function *func = AST::TheModule->getFunction(name);
+  if(func) return func;
+  func = Function::Create(
+      FunctionType::get(AST::DoubleTyID, std::vector<llvm::Type *> { AST::DoubleTyID }, false),
+      Function::ExternalLinkage, name, AST::TheModule.get());
+  func->setDoesNotThrow();
+  func->setDoesNotAccessMemory();
+#if LLVM_VERSION_MAJOR >= 11
+  func->addFnAttr(Attribute::WillReturn);
+#endif
+  return func;
+}
+
+// The mathematical and conversion routines become intrinsics or plain
+// instructions, which fold on constants, move out of loops and, with
+// --veclib, vectorize. Values are in their compiled types: integers and
+// characters i32, reals double. Returns nullptr for the other routines.
+inline Value *emitPureBuiltin(const Builtin &b, const std::vector<Value *> &args){
+  IRBuilder<> &B = AST::Builder;
+  for (Value *v : args) {
+    if(!v) return nullptr;
+  }
+  const char *n = b.name;
+  llvm::Type *real = AST::DoubleTyID;
+  Intrinsic::ID id = Intrinsic::not_intrinsic;
+  if(!strcmp(n, "fabs")) id = Intrinsic::fabs;
+  else if(!strcmp(n, "sqrt")) id = Intrinsic::sqrt;
+  else if(!strcmp(n, "sin")) id = Intrinsic::sin;
+  else if(!strcmp(n, "cos")) id = Intrinsic::cos;
+  else if(!strcmp(n, "exp")) id = Intrinsic::exp;
+  else if(!strcmp(n, "ln")) id = Intrinsic::log;
+  if(id != Intrinsic::not_intrinsic){
+    Function *f = Intrinsic::getDeclaration(AST::TheModule.get(), id, std::vector<llvm::Type *> { real });
+    return B.CreateCall(f, args);
+  }
+  if(!strcmp(n, "tan")) return B.CreateCall(declareLibm("tan"), args);
+  if(!strcmp(n, "arctan")) return B.CreateCall(declareLibm("atan"), args);
+  if(!strcmp(n, "pi")) return ConstantFP::get(real, 3.14159265358979323846);
+  if(!strcmp(n, "abs")){
+    Value *x = args[0];
+    return B.CreateSelect(B.CreateICmpSLT(x, ConstantInt::get(x->getType(), 0)), B.CreateNeg(x), x, "abstmp");
+  }
+  if(!strcmp(n, "trunc")) return B.CreateFPToSI(args[0], AST::i32, "trunctmp");
+  if(!strcmp(n, "round")){
+    Function *f = Intrinsic::getDeclaration(AST::TheModule.get(), Intrinsic::round, std::vector<llvm::Type *> { real });
+    return B.CreateFPToSI(B.CreateCall(f, args), AST::i32, "roundtmp");
+  }
+  // Characters are the low byte.
+  if(!strcmp(n, "chr") || !strcmp(n, "ord")) return B.CreateAnd(args[0], ConstantInt::get(args[0]->getType(), 0xFF));
+  return nullptr;
+}
+
+// The callee's function is known once its header was compiled (or forward
+// declared), library routines are declared on their first call.
+inline Value *emitCall(SymbolEntry *callee, Expr_list *expr_list){
+  if(callee->builtin && callee->builtin->pure){
+    std::vector<Value *> args;
+    if(expr_list){
+      for (Expr *e : expr_list->getList()) args.push_back(e->compile_r());
+    }
+    return emitPureBuiltin(*callee->builtin, args);
+  }
+  if(!callee->f && callee->builtin) callee->f = declareBuiltin(*callee->builtin);
+  if(!callee->f) return nullptr;
+  FunctionType *funcTy = callee->f->getFunctionType();
+  // The types of the actuals that go to var scalar formals, nullptr for the
+  // rest: routines of the program take their address (declareFunction).
+  std::vector<OurType *> byRef;
+  if(callee->formals && !callee->builtin){
+    for (Formal *f : callee->formals->getList()){
+      OurType *t = f->isReference() && f->getType()->val != TYPE_ARRAY ? f->getType() : nullptr;
+      byRef.insert(byRef.end(), f->getIdList().size(), t);
+    }
+  }
+  std::vector<Value *> args;
+  if(expr_list){
+    size_t k = 0;
+    for (Expr *e : expr_list->getList()){
+      llvm::Type *paramTy = funcTy->getParamType(args.size());
+      OurType *reference = k < byRef.size() ? byRef[k] : nullptr;
+      ++k;
+      if(reference){
+        if(dynamic_cast<Lval *>(e)){
+          args.push_back(e->compile());
+          continue;
+        }
+        // A value has no memory of its own, it gets a slot in the caller.
+        llvm::Type *t = storageType(reference);
+        Value *v = e->compile_r();
+        if(reference->val == TYPE_CHAR) v = AST::Builder.CreateTrunc(v, t);
+        else if(reference->val == TYPE_POINTER) v = AST::Builder.CreatePointerCast(v, t);
+        BasicBlock &entry = AST::Builder.GetInsertBlock()->getParent()->getEntryBlock();
+        IRBuilder<> Entry(&entry, entry.begin());
+        Value *slot = Entry.CreateAlloca(t, 0, "arg");
+        AST::Builder.CreateStore(v, slot);
+        args.push_back(slot);
+        continue;
+      }
+      // Arrays are never copied here, the library takes the first element
+      // only, routines of the program the length too.
+      if(e->type->val == TYPE_ARRAY){
+        Value *base = e->arrayBase();
+        if(base && base->getType() != paramTy) base = AST::Builder.CreatePointerCast(base, paramTy);
+        args.push_back(base);
+        if(!callee->builtin) args.push_back(e->arrayLength());
+        continue;
+      }
+      Value *v = e->compile_r();
+      // The runtime takes its integers wider than the language keeps them.
+      if(v && v->getType() != paramTy && v->getType()->isIntegerTy() && paramTy->isIntegerTy())
+        v = AST::Builder.CreateIntCast(v, paramTy, !v->getType()->isIntegerTy(1));
+      else if(v && v->getType() != paramTy && v->getType()->isPointerTy() && paramTy->isPointerTy())
+        v = AST::Builder.CreatePointerCast(v, paramTy);
+      args.push_back(v);
+    }
+  }
+  // Then what it uses of the enclosing routines, see Header::bindArguments.
+  for (SymbolEntry *v : callee->captures){
+    std::pair<Value *, Value *> here = variableHere(v);
+    args.push_back(here.first);
+    if(isArrayFormal(v)) args.push_back(here.second);
+  }
+  // A literal's length is known, the runtime need not look for its end.
+  if(callee->builtin && !strcmp(callee->builtin->name, "writeString")){
+    long long length = TheStrings.lengthOf(args[0]);
+    if(length >= 0) return AST::Builder.CreateCall(declareWriteStringN(), std::vector<Value *> { args[0], ConstantInt::get(AST::i64, length) });
+  }
+  CallInst *call = AST::Builder.CreateCall(callee->f, args);
+  Value *ret = call;
+  if(callee->builtin && ret->getType()->isIntegerTy()){
+    BuiltinType result = callee->builtin->result;
+    // Booleans come back as a byte that is 0 or 1.
+    if(result == B_BOOLEAN){
+      MDBuilder mdb(AST::TheContext);
+      call->setMetadata(LLVMContext::MD_range, mdb.createRange(APInt(8, 0), APInt(8, 2)));
+    }
+    unsigned bits = result == B_BOOLEAN ? 1 : 32;
+    ret = AST::Builder.CreateIntCast(ret, IntegerType::get(AST::TheContext, bits), result == B_INTEGER);
+  }
+  return ret;
+}
+
 class Call: public Stmt{
 public:
   Call(){
@@ -1009,7 +1575,7 @@ public:
     expr_list = e;
   }
   ~Call(){
-    delete id; delete expr_list;
+    delete id;
   }
   virtual void printOn(std::ostream &out) const override {
     out << "Call(";
@@ -1028,103 +1594,27 @@ public:
     return s;
   }
   virtual void run() const override {
-    std::cout << "Running Call";
+    diag() << "Running Call";
   }
   virtual void sem() override {
     std::string s = id;
     if(expr_list) expr_list->sem();
-    st.lookup(s);
+    entry = st.lookup(s);
+    st.addCall(entry);
     if(st.isProcedure(s)){
-
-      std::vector<Formal *> formal_list;
-      if(st.getFormalsProcedureAll(s)) formal_list = st.getFormalsProcedureAll(s)->getList();
-      int i = 0;
-      int argumentsExpected = 0;
-      int argumentsProvided = 0;
-      if(!formal_list.empty()){
-        for (Formal *f : formal_list) {
-          int FormalTimes;
-          FormalTimes = f->getIdList().size();
-          argumentsExpected += FormalTimes;
-        }
-      }
-      if(expr_list) argumentsProvided = expr_list->getList().size();
-      if(argumentsExpected != argumentsProvided){
-        std::cout << "Procedure " << s << " expected " << argumentsExpected << " arguments " << " got " << argumentsProvided;
-        std::cout << "\n";
-        exit(1);
-      }
-      if(!formal_list.empty()){
-        for (Formal *f : formal_list) {
-          int FormalTimes;
-          FormalTimes = f->getIdList().size();
-          for (int j=0; j<FormalTimes; j++){
-            if(!(*f->getType() == *expr_list->getList().at(i)->getType())){
-              ERROR("Type mismatch on procedure arguments!\n");
-              std::cout << "In procedure "<< s << " arguments:\n";
-              std::cout << f->getIdList().at(j);
-              std::cout << "\n and \n";
-              expr_list->getList().at(i)->printOn(std::cout);
-              std::cout << "\nHave different types of ";
-              f->getType()->printOn(std::cout);
-              std::cout << " and ";
-              expr_list->getList().at(i)->getType()->printOn(std::cout);
-              std::cout << "\n";
-              exit(1);
-            }
-            i += 1;
-          }
-        }
-      }
+      checkCallArguments(s, true, st.getFormalsProcedureAll(s), expr_list);
     }
     else if(st.isFunction(s)){
-      std::vector<Formal *> formal_list;
-      formal_list = st.getFormalsFunctionAll(s)->getList();
-      int i = 0;
-      int argumentsExpected = 0;
-      int argumentsProvided = 0;
-      if(!formal_list.empty()){
-        for (Formal *f : formal_list) {
-          int FormalTimes;
-          FormalTimes = f->getIdList().size();
-          argumentsExpected += FormalTimes;
-        }
-      }
-      if(expr_list) argumentsProvided = expr_list->getList().size();
-      if(argumentsExpected != argumentsProvided){
-        std::cout << "Procedure " << s << " expected " << argumentsExpected << " arguments " << " got " << argumentsProvided;
-        std::cout << "\n";
-        exit(1);
-      }
-      if(!formal_list.empty()){
-        for (Formal *f : formal_list) {
-          int FormalTimes;
-          FormalTimes = f->getIdList().size();
-          for (int j=0; j<FormalTimes; j++){
-            if(!(*f->getType() == *expr_list->getList().at(i)->getType())){
-              ERROR("Type mismatch on function arguments!\n");
-              std::cout << "In function "<< s << " arguments:\n";
-              std::cout << f->getIdList().at(j);
-              std::cout << "\n and \n";
-              expr_list->getList().at(i)->printOn(std::cout);
-              std::cout << "\nHave different types of ";
-              f->getType()->printOn(std::cout);
-              std::cout << " and ";
-              expr_list->getList().at(i)->getType()->printOn(std::cout);
-              exit(1);
-            }
-            i += 1;
-          }
-        }
-      }
+      checkCallArguments(s, false, st.getFormalsFunctionAll(s), expr_list);
     }
   }
-  virtual Value* compile() const override { return nullptr;}
-  virtual Value* compile_r() const override { return nullptr;}
+  virtual Value* compile() const override { return emitCall(entry, expr_list);}
+  virtual Value* compile_r() const override { return emitCall(entry, expr_list);}
 
 private:
   char* id;
   Expr_list *expr_list;
+  SymbolEntry *entry = nullptr;
 };
 
 class Callr: public Rval{
@@ -1137,9 +1627,6 @@ public:
     id = i;
     expr_list = e;
   }
-  ~Callr(){
-    delete expr_list;
-  }
   virtual void printOn(std::ostream &out) const override {
     out << "Callr(";
     if(id) out << id << " ";
@@ -1158,98 +1645,24 @@ public:
   }
   virtual void sem() override {
     std::string s = id;
-    type = st.lookup(s)->type;
+    entry = st.lookup(s);
+    st.addCall(entry);
+    type = entry->type;
     if(expr_list) expr_list->sem();
-    st.lookup(s);
     if(st.isProcedure(s)){
-      std::vector<Formal *> formal_list;
-      if(st.getFormalsProcedureAll(s)) formal_list = st.getFormalsProcedureAll(s)->getList();
-      int i = 0;
-      int argumentsExpected = 0;
-      int argumentsProvided = 0;
-      if(!formal_list.empty()){
-        for (Formal *f : formal_list) {
-          int FormalTimes;
-          FormalTimes = f->getIdList().size();
-          argumentsExpected += FormalTimes;
-        }
-      }
-      if(expr_list) argumentsProvided = expr_list->getList().size();
-      if(argumentsExpected != argumentsProvided){
-        std::cout << "Procedure " << s << " expected " << argumentsExpected << " arguments " << " got " << argumentsProvided;
-        std::cout << "\n";
-        exit(1);
-      }
-      if(!formal_list.empty()){
-        for (Formal *f : formal_list) {
-          int FormalTimes;
-          FormalTimes = f->getIdList().size();
-          for (int j=0; j<FormalTimes; j++){
-            if(!(*f->getType() == *expr_list->getList().at(i)->getType())){
-              ERROR("Type mismatch on procedure arguments!\n");
-              std::cout << "In procedure "<< s << " arguments:\n";
-              std::cout << f->getIdList().at(j);
-              std::cout << "\n and \n";
-              expr_list->getList().at(i)->printOn(std::cout);
-              std::cout << "\nHave different types of ";
-              f->getType()->printOn(std::cout);
-              std::cout << " and ";
-              expr_list->getList().at(i)->getType()->printOn(std::cout);
-              exit(1);
-            }
-            i += 1;
-          }
-        }
-      }
+      checkCallArguments(s, true, st.getFormalsProcedureAll(s), expr_list);
     }
     else if(st.isFunction(s)){
-      std::vector<Formal *> formal_list;
-      formal_list = st.getFormalsFunctionAll(s)->getList();
-      int i = 0;
-      int argumentsExpected = 0;
-      int argumentsProvided = 0;
-      if(!formal_list.empty()){
-        for (Formal *f : formal_list) {
-          int FormalTimes;
-          FormalTimes = f->getIdList().size();
-          argumentsExpected += FormalTimes;
-        }
-      }
-      if(expr_list) argumentsProvided = expr_list->getList().size();
-      if(argumentsExpected != argumentsProvided){
-        std::cout << "Procedure " << s << " expected " << argumentsExpected << " arguments " << " got " << argumentsProvided;
-        std::cout << "\n";
-        exit(1);
-      }
-      if(!formal_list.empty()){
-        for (Formal *f : formal_list) {
-          int FormalTimes;
-          FormalTimes = f->getIdList().size();
-          for (int j=0; j<FormalTimes; j++){
-            if(!(*f->getType() == *expr_list->getList().at(i)->getType())){
-              ERROR("Type mismatch on function arguments!\n");
-              std::cout << "In function "<< s << " arguments:\n";
-              std::cout << f->getIdList().at(j);
-              std::cout << "\n and \n";
-              expr_list->getList().at(i)->printOn(std::cout);
-              std::cout << "\nHave different types of ";
-              f->getType()->printOn(std::cout);
-              std::cout << " and ";
-              expr_list->getList().at(i)->getType()->printOn(std::cout);
-              exit(1);
-            }
-            i += 1;
-          }
-        }
-      }
+      checkCallArguments(s, false, st.getFormalsFunctionAll(s), expr_list);
     }
   }
-  virtual Value* compile() const override { return nullptr;}
-  virtual Value* compile_r() const override { return nullptr;}
+  virtual Value* compile() const override { return emitCall(entry, expr_list);}
+  virtual Value* compile_r() const override { return emitCall(entry, expr_list);}
 
 private:
   char *id;
   Expr_list *expr_list;
+  SymbolEntry *entry = nullptr;
 };
 
 class New: public Stmt{
@@ -1277,9 +1690,10 @@ public:
     return s;
   }
   virtual void run() const override {
-    std::cout << "Running New";
+    diag() << "Running New";
   }
   virtual void sem() override {
+    st.noteWrite();
     if(lval && exprBrackets){
       // "new" "[" expr "]" l-value
       lval->sem();
@@ -1291,29 +1705,32 @@ public:
         exprBrackets->type = st.lookup("result")->type;
       }
       if(lval->type->val != TYPE_POINTER){
-        printOn(std::cout);
-        std::cout << "\nIn expression new [expr] l-value, l-value must be a pointer but is of type ";
-        lval->type->printOn(std::cout);
-        std::cout << "\n";
-        exit(1);
+        printOn(diag());
+        diag() << "\nIn expression new [expr] l-value, l-value must be a pointer but is of type ";
+        lval->type->printOn(diag());
+        diag() << "\n";
+        compile_error();
       }
       else{
         if(lval->type->oftype->val != TYPE_ARRAY){
-          printOn(std::cout);
-          std::cout << "\nIn expression new [expr] l-value, l-value must be a pointer to array but is a pointer to ";
-          lval->type->oftype->printOn(std::cout);
-          std::cout << "\n";
-          exit(1);
+          printOn(diag());
+          diag() << "\nIn expression new [expr] l-value, l-value must be a pointer to array but is a pointer to ";
+          lval->type->oftype->printOn(diag());
+          diag() << "\n";
+          compile_error();
         }
       }
       if(exprBrackets->type->val != TYPE_INTEGER){
-        printOn(std::cout);
-        std::cout << "\nIn expression new [expr] l-value, expr must be of type integer, but it is of type ";
-        exprBrackets->type->oftype->printOn(std::cout);
-        std::cout << "\n";
-        exit(1);
+        printOn(diag());
+        diag() << "\nIn expression new [expr] l-value, expr must be of type integer, but it is of type ";
+        exprBrackets->type->oftype->printOn(diag());
+        diag() << "\n";
+        compile_error();
       }
-      st.makeNew(lval->getStringName());
+      st.makeNew(lval);
+      int count = 0;
+      if(!exprBrackets->constantValue(count) || count < 0) count = 0;
+      allocation = st.addAllocation(variable(), lval->type->oftype->oftype, count, true);
     }
     else{
       // "new" l-value
@@ -1322,21 +1739,78 @@ public:
         lval->type = st.lookup("result")->type;
       }
       if(lval->type->val != TYPE_POINTER){
-        printOn(std::cout);
-        std::cout << "\nIn expression new l-value, l-value must be a pointer but is of type ";
-        lval->type->printOn(std::cout);
-        std::cout << "\n";
-        exit(1);
+        printOn(diag());
+        diag() << "\nIn expression new l-value, l-value must be a pointer but is of type ";
+        lval->type->printOn(diag());
+        diag() << "\n";
+        compile_error();
+      }
+      if(isOpenArray(lval->type->oftype)){
+        printOn(diag());
+        diag() << "\nIn expression new l-value, l-value points to an array of unknown size, use new [expr] l-value\n";
+        compile_error();
       }
-      st.makeNew(lval->getStringName());
+      st.makeNew(lval);
+      allocation = st.addAllocation(variable(), lval->type->oftype, 1, false);
     }
+    objectUse(lval);
   }
-  virtual Value* compile() const override { return nullptr;}
-  virtual Value* compile_r() const override { return nullptr;}
+  // Objects placed by SymbolTable::placeAllocations are stack slots of the
+  // routine, allocated once on entry; the others come from the runtime.
+  virtual Value* compile() const override {
+    Value *addr = lval->compile();
+    if(!addr) return nullptr;
+    const SymbolTable::Allocation &a = st.allocations[allocation];
+    llvm::Type *object = exprBrackets ? objectType(lval->type->oftype) : storageType(lval->type->oftype);
+    bool counted = isOpenArray(lval->type->oftype);
+    Value *p, *n = nullptr;
+    if(a.onStack){
+      BasicBlock &entry = Builder.GetInsertBlock()->getParent()->getEntryBlock();
+      IRBuilder<> Entry(&entry, entry.begin());
+      if(counted){
+        // The count and the elements in one slot.
+        StructType *slot = StructType::get(TheContext, std::vector<llvm::Type *> { i64, ArrayType::get(object, a.count) });
+        p = Entry.CreateConstInBoundsGEP2_32(slot, Entry.CreateAlloca(slot, nullptr, "new"), 0, 1);
+        n = c32(a.count);
+      }
+      else p = Entry.CreateAlloca(object, exprBrackets ? c32(a.count) : nullptr, "new");
+    }
+    else{
+      Value *count = ConstantInt::get(i64, 1);
+      if(exprBrackets){
+        n = exprBrackets->compile_r();
+        if(!n) return nullptr;
+        count = Builder.CreateSExt(n, i64);
+      }
+      Value *bytes = Builder.CreateMul(count, ConstantExpr::getSizeOf(object), "bytes");
+      if(counted) bytes = Builder.CreateAdd(bytes, ConstantInt::get(i64, objectHeader));
+      p = Builder.CreateCall(allocator(), std::vector<Value *> { bytes }, "new");
+      if(counted) p = Builder.CreateConstInBoundsGEP1_32(i8, p, objectHeader);
+    }
+    if(counted) Builder.CreateStore(n, elementCount(p));
+    p = Builder.CreatePointerCast(p, storageType(lval->type));
+    return withTBAA(Builder.CreateStore(p, addr), lval->type);
+  }
+  virtual Value* compile_r() const override { return compile(); }
 
 private:
+  SymbolEntry *variable() const {
+    return dynamic_cast<Id *>(lval) ? lval->target() : nullptr;
+  }
+  // new of lib.a: i8 *new(i64 bytes).
+  static Function *allocator() {
+    Function *f = TheModule->getFunction("new");
+    if(f) return f;
+    f = Function::Create(
+        FunctionType::get(PointerType::get(i8, 0), std::vector<llvm::Type *> { i64 }, false),
+        Function::ExternalLinkage, "new", TheModule.get());
+    f->setDoesNotThrow();
+    f->setReturnDoesNotAlias();
+    return f;
+  }
   Expr *lval;
   Expr *exprBrackets;
+  size_t allocation = 0;
 };
 
 class Goto: public Stmt{
@@ -1359,21 +1833,22 @@ public:
     return s;
   }
   virtual void run() const override {
-    std::cout << "Running Goto";
+    diag() << "Running Goto";
   }
   virtual void sem() override {
+    st.noteLoop();
     std::string s;
     s = id;
     if(!st.isLabel(s)){
-      printOn(std::cout);
-      std::cout << "\n" << s << " is not a label in this scope!\n";
-      exit(1);
+      printOn(diag());
+      diag() << "\n" << s << " is not a label in this scope!\n";
+      compile_error();
     }
     else{
       if(!st.LabelHasStmt(s)){
-        printOn(std::cout);
-        std::cout << "\nLabel " << s << " does not correspond to a Stmt!\n";
-        exit(1);
+        printOn(diag());
+        diag() << "\nLabel " << s << " does not correspond to a Stmt!\n";
+        compile_error();
       }
     }
   }
@@ -1388,9 +1863,6 @@ private:
 class Stmt_list: public AST{
 public:
   Stmt_list(): stmt_list(){}
-  ~Stmt_list() {
-    for (Stmt *s : stmt_list) delete s;
-  }
   void append_stmt(Stmt *s) { if(s) stmt_list.push_back(s); }
   void append_begin(Stmt *s) { if(s) stmt_list.insert(stmt_list.begin(), s); }
   virtual void printOn(std::ostream &out) const override {
@@ -1418,10 +1890,16 @@ public:
     return s;
   }
   virtual void sem() override {
-    for (Stmt *s : stmt_list) s->sem();
+    for (Stmt *s : stmt_list) {
+      LineScope at(s->line);
+      s->sem();
+    }
   }
   virtual Value* compile() const override {
-    for (Stmt *s : stmt_list) s->compile();
+    for (Stmt *s : stmt_list) {
+      markLine(s->line);
+      s->compile();
+    }
     return nullptr;
   }
   virtual Value* compile_r() const override {
@@ -1457,9 +1935,19 @@ public:
   virtual int get(){
     return con;
   }
+  virtual bool constantValue(int &value) const override {
+    value = con;
+    return true;
+  }
   virtual Value* compile() const override { return c32(con);}
   virtual Value* compile_r() const override { return c32(con);}
 
+  virtual bool sameAs(AST *that) override {
+    Constint *t = dynamic_cast<Constint *>(that);
+    return t && con == t->con;
+  }
+protected:
+  virtual uint64_t computeFingerprint() override { return mix(5, con); }
 private:
   int con;
 };
@@ -1482,8 +1970,11 @@ public:
   }
   virtual int eval() const override { return 0; } //wrong
   // virtual void sem() override { type = new Char(); }
-  virtual Value* compile() const override { return nullptr;}
-  virtual Value* compile_r() const override { return nullptr;}
+  // The quotes and escape sequences are read as in strings.
+  virtual Value* compile() const override {
+    return c32((unsigned char) StringPool::decode(con)[0]);
+  }
+  virtual Value* compile_r() const override { return compile(); }
 
 private:
   char *con;
@@ -1491,8 +1982,9 @@ private:
 
 class Conststring: public Lval {
 public:
+  // The characters, escape sequences decoded, and the NUL after them.
   Conststring(char *c): con(c) {
-    type = new Array(new Char(), strlen(c) - 1);}
+    type = new Array(new Char(), StringPool::decode(c).size() + 1);}
   virtual void printOn(std::ostream &out) const override {
     out << "Conststring(" << con << ")";
   }
@@ -1505,11 +1997,19 @@ public:
   }
   virtual int eval() const override { return 0; } //wrong
   // virtual void sem() override { type = new String(); }
-  virtual Value* compile() const override { return nullptr;}
-  virtual Value* compile_r() const override { return nullptr;}
+  // Pooled, unless an assignment stores into it.
+  virtual Value* compile() const override {
+    if(written) return TheStrings.copy(StringPool::decode(con));
+    return TheStrings.get(StringPool::decode(con));
+  }
+  virtual Value* compile_r() const override { return compile(); }
+  virtual void markWritten() override { written = true; }
+  // Already the first character.
+  virtual Value *arrayBase() const override { return compile(); }
 
 private:
   char *con;
+  bool written = false;
 };
 
 class Constreal: public Rval {
@@ -1576,7 +2076,7 @@ public:
   }
   virtual int eval() const override { return 0; } //wrong
   virtual Value* compile() const override { return nullptr;}
-  virtual Value* compile_r() const override { return nullptr;}
+  virtual Value* compile_r() const override { return ConstantPointerNull::get(PointerType::get(i8, 0));}
 
 private:
   char *con;
@@ -1598,7 +2098,7 @@ public:
   }
   virtual int eval() const override { return 0; } //wrong
   virtual Value* compile() const override { return nullptr;}
-  virtual Value* compile_r() const override { return nullptr;}
+  virtual Value* compile_r() const override { return ConstantPointerNull::get(PointerType::get(i8, 0));}
 
 private:
   char *con;
@@ -1623,63 +2123,85 @@ public:
     return s;
   }
   virtual void run() const override {
-    std::cout << "Running Dispose";
+    diag() << "Running Dispose";
   }
   virtual void sem() override {
+    st.noteWrite();
+    object = lval;
     if(lval && !isBracket){
       // dispose l-value
       lval->sem();
+      objectUse(lval);
       if(lval->type->val == TYPE_RES){
         lval->type = st.lookup("result")->type;
       }
       if(lval->type->val != TYPE_POINTER){
-        printOn(std::cout);
-        std::cout << "\nIn expression dispose l-value, l-value must be a pointer but is of type ";
-        lval->type->printOn(std::cout);
-        std::cout << "\n";
-        exit(1);
+        printOn(diag());
+        diag() << "\nIn expression dispose l-value, l-value must be a pointer but is of type ";
+        lval->type->printOn(diag());
+        diag() << "\n";
+        compile_error();
       }
-      if(!st.isNew(lval->getStringName())){
-        printOn(std::cout);
-        std::cout << "\nIn expression dispose l-value, l-value must have had been created by new l-value\n";
-        exit(1);
+      if(!st.isNew(lval)){
+        printOn(diag());
+        diag() << "\nIn expression dispose l-value, l-value must have had been created by new l-value\n";
+        compile_error();
       }
       lval = new NilL();
     }
     else{
       // dispose [] l-value
       lval->sem();
+      objectUse(lval);
       if(lval->type->val == TYPE_RES){
         lval->type = st.lookup("result")->type;
       }
       if(lval->type->val != TYPE_POINTER){
-        printOn(std::cout);
-        std::cout << "\nIn expression dispose [] l-value, l-value must be a pointer but is of type ";
-        lval->type->printOn(std::cout);
-        std::cout << "\n";
-        exit(1);
+        printOn(diag());
+        diag() << "\nIn expression dispose [] l-value, l-value must be a pointer but is of type ";
+        lval->type->printOn(diag());
+        diag() << "\n";
+        compile_error();
       }
-      if(!st.isNew(lval->getStringName())){
-        printOn(std::cout);
-        std::cout << "\nIn expression dispose [] l-value, l-value must have had been created by new l-value\n";
-        exit(1);
+      if(!st.isNew(lval)){
+        printOn(diag());
+        diag() << "\nIn expression dispose [] l-value, l-value must have had been created by new l-value\n";
+        compile_error();
       }
       if(lval->type->oftype->val != TYPE_ARRAY){
-        printOn(std::cout);
-        std::cout << "\nIn expression dispose [] l-value, l-value must be a pointer to array but is a pointer to ";
-        lval->type->oftype->printOn(std::cout);
-        std::cout << "\n";
-        exit(1);
+        printOn(diag());
+        diag() << "\nIn expression dispose [] l-value, l-value must be a pointer to array but is a pointer to ";
+        lval->type->oftype->printOn(diag());
+        diag() << "\n";
+        compile_error();
       }
       lval = new NilL();
     }
 }
 
-virtual Value* compile() const override { return nullptr;}
-virtual Value* compile_r() const override { return nullptr;}
+// Objects on the stack go with their frame.
+virtual Value* compile() const override {
+  Id *id = dynamic_cast<Id *>(object);
+  if(!object || (id && id->target()->onStack)) return nullptr;
+  Value *p = object->compile_r();
+  if(!p) return nullptr;
+  // From where new [n] put the count.
+  if(isOpenArray(object->type->oftype))
+    p = Builder.CreateConstGEP1_32(i8, Builder.CreatePointerCast(p, PointerType::get(i8, 0)), -(int)objectHeader);
+  Function *f = TheModule->getFunction("dispose");
+  if(!f){
+    f = Function::Create(
+        FunctionType::get(Type::getVoidTy(TheContext), std::vector<llvm::Type *> { PointerType::get(i8, 0) }, false),
+        Function::ExternalLinkage, "dispose", TheModule.get());
+    f->setDoesNotThrow();
+  }
+  return Builder.CreateCall(f, std::vector<Value *> { Builder.CreatePointerCast(p, PointerType::get(i8, 0)) });
+}
+virtual Value* compile_r() const override { return compile(); }
 
 private:
   Expr *lval;
+  Expr *object = nullptr; // lval before sem, which leaves nil there
   bool isBracket;
 };
 
@@ -1687,7 +2209,6 @@ class If: public Stmt {
 public:
   If(Expr *c, Stmt *s1, Stmt *s2 = nullptr):
     cond(c), stmt1(s1), stmt2(s2) {    }
-  ~If() { delete cond; delete stmt1; delete stmt2; }
   virtual void printOn(std::ostream &out) const override {
     out << "If(";
     if(cond) cond->printOn(out);
@@ -1710,11 +2231,11 @@ public:
       cond->type = st.lookup("result")->type;
     }
     if(cond->type->val == TYPE_BOOLEAN){
-      stmt1->sem();
-      if (stmt2 != nullptr) stmt2->sem();
+      { LineScope at(stmt1->line); stmt1->sem(); }
+      if (stmt2 != nullptr) { LineScope at(stmt2->line); stmt2->sem(); }
     }
     else{
-      ERROR("Type mismatch, cond is not bool!\n"); printOn(std::cout); exit(1);
+      ERROR("Type mismatch, cond is not bool!\n"); printOn(diag()); compile_error();
     }
   }
   virtual void run() const override {
@@ -1734,13 +2255,19 @@ public:
     BasicBlock *AfterBB =
       BasicBlock::Create(TheContext, "endif", TheFunction);
     Builder.CreateCondBr(v, ThenBB, ElseBB);
+    TheSSA.seal(ThenBB);
+    TheSSA.seal(ElseBB);
     Builder.SetInsertPoint(ThenBB);
+    markLine(stmt1->line);
     stmt1->compile();
     Builder.CreateBr(AfterBB);
     Builder.SetInsertPoint(ElseBB);
-    if (stmt2 != nullptr)
+    if (stmt2 != nullptr){
+      markLine(stmt2->line);
       stmt2->compile();
+    }
     Builder.CreateBr(AfterBB);
+    TheSSA.seal(AfterBB);
     Builder.SetInsertPoint(AfterBB);
     return nullptr;
   }
@@ -1755,13 +2282,19 @@ public:
     BasicBlock *AfterBB =
       BasicBlock::Create(TheContext, "endif", TheFunction);
     Builder.CreateCondBr(v, ThenBB, ElseBB);
+    TheSSA.seal(ThenBB);
+    TheSSA.seal(ElseBB);
     Builder.SetInsertPoint(ThenBB);
+    markLine(stmt1->line);
     stmt1->compile();
     Builder.CreateBr(AfterBB);
     Builder.SetInsertPoint(ElseBB);
-    if (stmt2 != nullptr)
+    if (stmt2 != nullptr){
+      markLine(stmt2->line);
       stmt2->compile();
+    }
     Builder.CreateBr(AfterBB);
+    TheSSA.seal(AfterBB);
     Builder.SetInsertPoint(AfterBB);
     return nullptr;
   }
@@ -1774,12 +2307,11 @@ private:
 class While: public Stmt {
 public:
   While(Expr *e, Stmt *s): expr(e), stmt(s) { }
-  ~While() { delete expr; delete stmt; }
   virtual void printOn(std::ostream &out) const override {
     out << "While(";
-    if(expr) expr->printOn(std::cout);
+    if(expr) expr->printOn(out);
     out << ", ";
-    if(stmt) stmt->printOn(std::cout);
+    if(stmt) stmt->printOn(out);
     out << ")";
   }
   virtual std::string getStringName() override {
@@ -1792,15 +2324,17 @@ public:
     return s;
   }
   virtual void sem() override {
+    st.noteLoop();
     expr->sem();
     if(expr->type->val == TYPE_RES){
       expr->type = st.lookup("result")->type;
     }
     if(expr->type->val == TYPE_BOOLEAN){
+      LineScope at(stmt->line);
       stmt->sem();
     }
     else{
-      ERROR("Type mismatch!\n"); exit(1);
+      ERROR("Type mismatch!\n"); compile_error();
     }
   }
   virtual void run() const override {
@@ -1824,13 +2358,20 @@ public:
     phi_iter->addIncoming(n, PrevBB);
     Value *loop_cond = Builder.CreateICmpNE(phi_iter, c1(0), "loop_cond");
     Builder.CreateCondBr(loop_cond, BodyBB, AfterBB);
+    TheSSA.seal(BodyBB);
+    TheSSA.seal(AfterBB);
     Builder.SetInsertPoint(BodyBB);
 
+    markLine(stmt->line);
     stmt->compile();
+    // The condition again, at the end of every round.
+    markLine(line);
     n = expr->compile_r();
 
     phi_iter->addIncoming(n, Builder.GetInsertBlock());
     Builder.CreateBr(LoopBB);
+    // The back edge was the last way into the loop header.
+    TheSSA.seal(LoopBB);
     Builder.SetInsertPoint(AfterBB);
 
     return nullptr;
@@ -1851,13 +2392,20 @@ public:
     phi_iter->addIncoming(n, PrevBB);
     Value *loop_cond = Builder.CreateICmpNE(phi_iter, c1(0), "loop_cond");
     Builder.CreateCondBr(loop_cond, BodyBB, AfterBB);
+    TheSSA.seal(BodyBB);
+    TheSSA.seal(AfterBB);
     Builder.SetInsertPoint(BodyBB);
 
+    markLine(stmt->line);
     stmt->compile();
+    // The condition again, at the end of every round.
+    markLine(line);
     n = expr->compile_r();
 
     phi_iter->addIncoming(n, Builder.GetInsertBlock());
     Builder.CreateBr(LoopBB);
+    // The back edge was the last way into the loop header.
+    TheSSA.seal(LoopBB);
     Builder.SetInsertPoint(AfterBB);
     return nullptr;
     }
@@ -1872,9 +2420,6 @@ public:
   Block(Stmt_list *s = nullptr){
     if(s) stmt_list = s;
   }
-  ~Block(){
-    delete stmt_list;
-  }
   virtual void printOn(std::ostream &out) const override {
     out << "Block(";
     if(stmt_list) stmt_list->printOn(out);
@@ -1891,7 +2436,7 @@ public:
     stmt_list->sem();
   }
 virtual void run() const override {
-  std::cout << "Running block";
+  diag() << "Running block";
 }
 virtual Value* compile() const override {
   stmt_list->compile();
@@ -1910,6 +2455,161 @@ class Header: public AST{
 public:
   virtual char *getFunctionName(){return nullptr;};
   virtual OurType *getFunctionType(){return nullptr;};
+  // Emits (or finds, if it was forward declared) the llvm declaration.
+  virtual Function *declare() const { return nullptr; }
+  SymbolEntry *getEntry() const { return entry; }
+  int line = 0;
+protected:
+  // The routine's own entry and the formals its body binds, set by sem.
+  SymbolEntry *entry = nullptr;
+  Formal_list *params = nullptr;
+  // Gives every parameter passed by value a stack slot, the body addresses
+  // them like locals; a var scalar is the address the caller passed.
+  // An array comes as its first element and its length and stays where the
+  // caller has it. One passed by value is copied only when this routine may
+  // change it or the caller's memory under it: it assigns to the array,
+  // passes it on by reference, takes its address or writes memory at all.
+  // The variables of enclosing routines come last, see declareFunction.
+  void bindArguments(Function *func) const {
+    auto arg = func->arg_begin();
+    if(params) for (Formal *f : params->getList()){
+      for (SymbolEntry *e : f->getEntries()){
+        if(f->getType()->val == TYPE_ARRAY){
+          Value *base = &*arg++;
+          e->length = &*arg++;
+          e->v = base;
+          if(!e->byRef && (e->written || e->addressTaken || !entry || entry->writesMemory)){
+            llvm::Type *element = storageType(f->getType()->oftype);
+            e->v = Builder.CreateAlloca(element, e->length, e->s);
+            copyElements(e->v, base, e->length, element);
+          }
+          continue;
+        }
+        // A var scalar is the caller's variable, reached through its address.
+        if(f->isReference()){
+          e->val = &*arg++;
+          continue;
+        }
+        if(inRegister(e, f->getType())){
+          e->ssaType = arg->getType();
+          TheSSA.write(e, Builder.GetInsertBlock(), &*arg);
+          ++arg;
+          continue;
+        }
+        AllocaInst *Alloca = Builder.CreateAlloca(arg->getType(), 0, e->s);
+        Builder.CreateStore(&*arg, Alloca);
+        e->val = Alloca;
+        ++arg;
+      }
+    }
+    if(!entry) return;
+    for (SymbolEntry *v : entry->captures){
+      Value *address = &*arg++;
+      v->capturedIn[func] = std::make_pair(address, isArrayFormal(v) ? &*arg++ : nullptr);
+    }
+  }
+  // Remembers where the routine is defined, profilers report it.
+  void annotate(Function *func) const {
+    if(line) func->setMetadata("pcl.line", MDNode::get(TheContext, ConstantAsMetadata::get(c32(line))));
+  }
+  static llvm::Type *argType(OurType *t){
+    switch(t->val) {
+      case TYPE_INTEGER: return i32;
+      case TYPE_REAL: return DoubleTyID;
+      case TYPE_BOOLEAN: return i1;
+      case TYPE_CHAR: case TYPE_POINTER: return storageType(t);
+      default: return i32;
+    }
+  }
+  Function *declareFunction(std::string Name, llvm::Type *returnTy, Formal_list *formals) const {
+    Function *func = TheModule->getFunction(Name);
+    if(!func){
+      std::vector<llvm::Type *> args;
+      if(formals){
+        for (Formal *f : formals->getList()){
+          for (size_t i = 0; i < f->getIdList().size(); i++){
+            OurType *t = f->getType();
+            if(t->val == TYPE_ARRAY){
+              args.push_back(PointerType::get(storageType(t->oftype), 0));
+              args.push_back(i32);
+            }
+            else if(f->isReference()) args.push_back(PointerType::get(storageType(t), 0));
+            else args.push_back(argType(t));
+          }
+        }
+      }
+      // A pointer to each variable of an enclosing routine it uses.
+      if(entry){
+        for (SymbolEntry *v : entry->captures){
+          if(isArrayFormal(v)){
+            args.push_back(PointerType::get(storageType(v->type->oftype), 0));
+            args.push_back(i32);
+          }
+          else args.push_back(PointerType::get(storageType(v->type), 0));
+        }
+      }
+      // Nothing outside the program calls its routines.
+      func = Function::Create(
+          FunctionType::get(returnTy, args, false),
+          Function::InternalLinkage,
+          Name,
+          TheModule.get()
+      );
+      if(entry){
+        annotateEffects(func);
+        annotateParameters(func);
+      }
+    }
+    if(entry) entry->f = func;
+    return func;
+  }
+  // What SymbolTable::inferEffects proved about the routine.
+  void annotateEffects(Function *func) const {
+    func->setDoesNotThrow();
+    // Overflow traps and profiling hooks are calls the analysis never saw.
+    if(opts.checkOverflow || opts.profileGenerate || opts.profileProcedures || opts.profileSample) return;
+    if(!entry->readsMemory && !entry->writesMemory) func->setDoesNotAccessMemory();
+    else if(!entry->writesMemory) func->setOnlyReadsMemory();
+#if LLVM_VERSION_MAJOR >= 11
+    if(entry->returns) func->addFnAttr(Attribute::WillReturn);
+#endif
+  }
+  // Values of different PCL types never overlap, an array's elements are
+  // its element type's.
+  static int memoryKind(OurType *t){
+    while(t->val == TYPE_ARRAY) t = t->oftype;
+    return t->val;
+  }
+  // A var scalar is a whole variable of the caller (dereferenceable), kept
+  // nowhere unless its address is taken or passed on (nocapture), and only
+  // reached through this parameter (noalias) when no other parameter may
+  // point at its type and the routine, or what it calls, reaches no memory
+  // of the caller's but through parameters.
+  void annotateParameters(Function *func) const {
+    if(!entry->formals) return;
+    std::map<int, int> pointing;
+    for (Formal *f : entry->formals->getList()){
+      if(f->isReference() || f->getType()->val == TYPE_ARRAY)
+        pointing[memoryKind(f->getType())] += f->getEntries().size();
+    }
+    for (SymbolEntry *v : entry->captures) pointing[memoryKind(v->type)]++;
+    unsigned i = 0;
+    for (Formal *f : entry->formals->getList()){
+      OurType *t = f->getType();
+      for (SymbolEntry *e : f->getEntries()){
+        if(t->val == TYPE_ARRAY){
+          i += 2;
+          continue;
+        }
+        if(f->isReference()){
+          func->addDereferenceableParamAttr(i, SymbolTable::storageBytes(t));
+          if(!e->addressTaken) func->addParamAttr(i, Attribute::NoCapture);
+          if(pointing[memoryKind(t)] == 1 && !entry->reachesShared) func->addParamAttr(i, Attribute::NoAlias);
+        }
+        ++i;
+      }
+    }
+  }
 };
 
 
@@ -1920,9 +2620,6 @@ public:
   Label(Id_list *i_l){
     id_list = i_l;
   };
-  ~Label(){
-    delete id_list;
-  };
   virtual void printOn(std::ostream &out) const override {
     out << "Label(";
     id_list->printOn(out);
@@ -1936,10 +2633,8 @@ public:
     return s;
   };
   virtual void sem() override {
-    std::vector<char *> v;
     std::string s;
-    v = id_list->getlist();
-    for(char* c : v){
+    for(char* c : id_list->getlist()){
       s = c;
       st.insertLabel(s, new TypeLabel());
     }
@@ -1972,93 +2667,46 @@ public:
     s += ")";
     return s;
   }
+  int line = 0;
   virtual void sem() override{
+    entries.clear();
     for (char *id : id_list->getlist()) {
       std::string var = id;
       st.insert(var, type);
+      entries.push_back(st.lookup(var));
+      entries.back()->owner = st.routine;
+      entries.back()->local = true;
     }
   }
+  // The main program's variables are module globals, which the routines,
+  // functions of their own, reach as well. A routine's live in its frame.
   virtual Value* compile() const override {
-
-    for (char *id : id_list->getlist()) {
-      std::string var = id;
-      // Value *v;
-      // Value *V = st.lookup(s)->val;
-
-      AllocaInst *Alloca;
-
-      if(type->val == TYPE_INTEGER){
-        Alloca = Builder.CreateAlloca(IntegerType::get(TheContext, 32), 0, var);
-        // Alloca->print(errs());
+    for (SymbolEntry *e : entries) {
+      if(inRegister(e, type)){
+        e->ssaType = type->val == TYPE_INTEGER ? i32 : type->val == TYPE_REAL ? DoubleTyID : i1;
+        continue;
       }
-      else if(type->val == TYPE_REAL){
-        Alloca = Builder.CreateAlloca(Type::getDoubleTy(TheContext), 0, var);
+      llvm::Type *t = storageType(type);
+      if(!e->owner){
+        e->val = new GlobalVariable(*TheModule, t, false, GlobalValue::InternalLinkage, Constant::getNullValue(t), e->s);
       }
-      else{
-        Alloca = Builder.CreateAlloca(IntegerType::get(TheContext, 1), 0, var);
-      }
-
-      // name[1] = '\0';
-      st.insert(var, type, Alloca);
-    }
-    // for (char *id : id_list->getlist()) {
-    //   std::string var = id;
-    //   int offset = 0;
-    //   char name[] = { *var, '_', 'p', 't', 'r', '\0' };
-    //   Value *v = Builder.CreateGEP(
-    //       TheVars, std::vector<Value *>{ c32(0), c32(offset)}, var);
-    //   // name[1] = '\0';
-    //   Builder.CreateLoad(v, var);
-    //   return v;
-    // }
+      else e->val = Builder.CreateAlloca(t, 0, e->s);
+    }
     return nullptr;
   }
   virtual Value* compile_r() const override {
-    for (char *id : id_list->getlist()) {
-      std::string var = id;
-      // Value *v;
-      // Value *V = st.lookup(s)->val;
-
-      AllocaInst *Alloca;
-
-      if(type->val == TYPE_INTEGER){
-        Alloca = Builder.CreateAlloca(IntegerType::get(TheContext, 32), 0, var);
-      }
-      else if(type->val == TYPE_REAL){
-        Alloca = Builder.CreateAlloca(Type::getDoubleTy(TheContext), 0, var);
-      }
-      else{
-        Alloca = Builder.CreateAlloca(IntegerType::get(TheContext, 1), 0, var);
-
-      }
-      // name[1] = '\0';
-      // Value *ret = Builder.CreateLoad(v, var);
-      st.insert(var, type, Alloca);
-    }
-    // for (char *id : id_list->getlist()) {
-    //   std::string var = id;
-    //   int offset = 0;
-    //   char name[] = { *var, '_', 'p', 't', 'r', '\0' };
-    //   Value *v = Builder.CreateGEP(
-    //       TheVars, std::vector<Value *>{ c32(0), c32(offset)}, var);
-    //   // name[1] = '\0';
-    //   Builder.CreateLoad(v, var);
-    //   return v;
-    // }
-    return nullptr;
+    return compile();
   }
 
 private:
   Id_list *id_list;
   OurType *type;
+  std::vector<SymbolEntry *> entries;
 };
 
 class Decl_list: public AST{
 public:
   Decl_list(): decl_list(){}
-  ~Decl_list() {
-    for (Decl *d : decl_list) delete d;
-  }
   void append_decl(Decl *d) { decl_list.push_back(d); }
   void append_begin(Decl *d) { decl_list.insert(decl_list.begin(), d); }
 
@@ -2085,7 +2733,10 @@ public:
     return s;
   }
   virtual void sem() override {
-    for (Decl *d : decl_list) d->sem();
+    for (Decl *d : decl_list) {
+      LineScope at(d->line);
+      d->sem();
+    }
   }
   virtual Value* compile() const override {
     for (Decl *d : decl_list) d->compile();
@@ -2110,7 +2761,7 @@ public:
     formal_list = f;
   }
   ~Procedure(){
-    delete id; delete formal_list;
+    delete id;
   }
   virtual void printOn(std::ostream &out) const override {
     out << "Procedure(";
@@ -2129,26 +2780,20 @@ public:
     return s;
   }
   virtual void semForward() override{
+    LineScope at(line);
     std::string s = id;
     st.insertProcedureForward(s, new ProcedureType(), formal_list);
+    entry = st.lookup(s);
   }
   virtual void sem() override {
+    LineScope at(line);
     std::string s = id;
     if(st.isForward(s)){
       //Procedure was previously forward declared
-      std::string prev;
-      std::string now;
-      if(st.getFormalsProcedure(s)){
-        prev = st.getFormalsProcedure(s)->getStringName();
-        now = formal_list->getStringName();
-      }
-      else{
-        prev = "";
-        now = "";
-      }
-      if(prev.compare(now)){
-        std::cout << "Procedure " << s << " was previously declared with arguments: " << prev << " but now it is defined with arguments " << now << "\n";
-        exit(1);
+      Formal_list *prev = st.getFormalsProcedure(s);
+      if(prev && !sameNode(prev, formal_list)){
+        diag() << "Procedure " << s << " was previously declared with arguments: " << prev->getStringName() << " but now it is defined with arguments " << (formal_list ? formal_list->getStringName() : "") << "\n";
+        compile_error();
       }
       st.removeForward(s);
       st.insertParent(s);
@@ -2156,8 +2801,21 @@ public:
     else{
       st.insertProcedure(s, new ProcedureType(), formal_list);
     }
+    entry = st.lookup(s);
+    params = st.getFormalsProcedureAll(s);
+    entry->formals = params;
+  }
+  virtual Function *declare() const override {
+    return declareFunction(id, Type::getVoidTy(TheContext), formal_list);
+  }
+  virtual Function *compile() const override {
+    Function *func = declare();
+    annotate(func);
+    BasicBlock *BB = BasicBlock::Create(TheContext, "entry", func);
+    Builder.SetInsertPoint(BB);
+    bindArguments(func);
+    return func;
   }
-  virtual Value* compile() const override { return nullptr;}
   virtual Value* compile_r() const override { return nullptr;}
 
 private:
@@ -2173,7 +2831,7 @@ public:
     formal_list = f;
   }
   ~OurFunction(){
-    delete id; delete formal_list;
+    delete id;
   }
   virtual void printOn(std::ostream &out) const override {
     out << "OurFunction(";
@@ -2194,31 +2852,25 @@ public:
     return s;
   }
   virtual void semForward() override{
+    LineScope at(line);
     std::string s = id;
     st.insertFunctionForward(s, type, formal_list);
+    entry = st.lookup(s);
   }
   virtual void sem() override {
+    LineScope at(line);
     std::string s = id;
     if(type->val == TYPE_ARRAY){
-      std::cout << "Function " << s << " , can not be of type Array\n";
-      exit(1);
+      diag() << "Function " << s << " , can not be of type Array\n";
+      compile_error();
 
     }
     if(st.isForward(s)){
       //Function was previously forward declared
-      std::string prev;
-      std::string now;
-      if(st.getFormalsProcedure(s)){
-        prev = st.getFormalsProcedure(s)->getStringName();
-        now = formal_list->getStringName();
-      }
-      else{
-        prev = "";
-        now = "";
-      }
-      if(prev.compare(now)){
-        std::cout << "Function " << s << " was previously declared with arguments: " << prev << " but now it is defined with arguments " << now << "\n";
-        exit(1);
+      Formal_list *prev = st.getFormalsFunction(s);
+      if(prev && !sameNode(prev, formal_list)){
+        diag() << "Function " << s << " was previously declared with arguments: " << prev->getStringName() << " but now it is defined with arguments " << (formal_list ? formal_list->getStringName() : "") << "\n";
+        compile_error();
       }
       st.removeForward(s);
       st.insertParent(s);
@@ -2227,6 +2879,9 @@ public:
     else{
       st.insertFunction(s, type, formal_list);
     }
+    entry = st.lookup(s);
+    params = st.getFormalsFunctionAll(s);
+    entry->formals = params;
   }
   virtual char *getFunctionName() override{
     return id;
@@ -2234,41 +2889,22 @@ public:
   virtual OurType *getFunctionType() override{
     return type;
   }
-  virtual Function *compile() const override {
-    //Check if previously forward declared ?
-    std::string Name = id;
-    Twine name = Twine(Name);
+  virtual Function *declare() const override {
     llvm::Type *returnTy;
-    llvm::Type *argTy;
     switch(type->val) {
       case TYPE_INTEGER: returnTy = i32; break;
       case TYPE_REAL: returnTy = DoubleTyID; break;
       case TYPE_BOOLEAN: returnTy = i1; break;
       default: returnTy = i32; break;
     }
-
-    std::vector<llvm::Type *> args;
-    std::vector<Formal *> FL = formal_list->getList();
-    for (Formal *f : FL){
-      switch(f->getType()->val) {
-        case TYPE_INTEGER: argTy = i32; break;
-        case TYPE_REAL: argTy = DoubleTyID; break;
-        case TYPE_BOOLEAN: argTy = i1; break;
-        default: argTy = i32; break;
-      }
-      args.push_back(argTy);
-    }
-    // fill up the args vector with types
-
-    Function *func = Function::Create(
-        FunctionType::get(returnTy, args, false),
-        Function::ExternalLinkage,
-        name,
-        TheModule.get()
-    );
+    return declareFunction(id, returnTy, formal_list);
+  }
+  virtual Function *compile() const override {
+    Function *func = declare();
+    annotate(func);
     BasicBlock *BB = BasicBlock::Create(TheContext, "entry", func);
     Builder.SetInsertPoint(BB);
-    st.insert(Name, func);
+    bindArguments(func);
     return func;
   }
   virtual Value* compile_r() const override { return nullptr;}
@@ -2342,6 +2978,36 @@ public:
     return s;
   };
   virtual void sem() override {
+    // StreamCompiler checks the program's own locals while parsing.
+    if(checked) return;
+    if(localType.compare("var") == 0){
+      decl_list->sem();
+    }
+    else if(localType.compare("label") == 0){
+      label->sem();
+    }
+    else if(localType.compare("forp") == 0){
+      header->sem();
+      st.routines.push_back(header->getEntry());
+      // Calls in the body are the routine's own.
+      SymbolEntry *caller = st.routine;
+      st.routine = header->getEntry();
+      try {
+        body->sem();
+      } catch (CompileError &) {
+        st.routine = caller;
+        throw;
+      }
+      st.routine = caller;
+    }
+    else if(localType.compare("forward") == 0){
+      header->semForward();
+    }
+    checked = true;
+  }
+  // Enters what this local declares, without checking the bodies of its
+  // routines: the incremental engine does this for parts that did not change.
+  void declare(){
     if(localType.compare("var") == 0){
       decl_list->sem();
     }
@@ -2350,8 +3016,6 @@ public:
     }
     else if(localType.compare("forp") == 0){
       header->sem();
-      body->sem();
-
     }
     else if(localType.compare("forward") == 0){
       header->semForward();
@@ -2371,11 +3035,22 @@ public:
       label->compile();
     }
     else if(localType.compare("forp") == 0){
+      // Nothing the main block can reach calls it.
+      if(!header->getEntry()->reachable) return nullptr;
+      // The routine gets a function of its own, code generation continues
+      // where it was in the enclosing one afterwards.
+      BasicBlock *PrevBB = Builder.GetInsertBlock();
       header->compile();
       body->compile();
+      if(!Builder.GetInsertBlock()->getTerminator()){
+        llvm::Type *retTy = Builder.GetInsertBlock()->getParent()->getReturnType();
+        if(retTy->isVoidTy()) Builder.CreateRetVoid();
+        else Builder.CreateRet(UndefValue::get(retTy));
+      }
+      Builder.SetInsertPoint(PrevBB);
     }
     else if(localType.compare("forward") == 0){
-      header->compile();
+      if(header->getEntry()->reachable) header->declare();
     }
     return nullptr;
   }
@@ -2402,14 +3077,12 @@ private:
   Header *header;
   AST *body;
   std::string localType;
+  bool checked = false;
 };
 
 class Local_list: public AST{
 public:
   Local_list(): local_list(){}
-  ~Local_list() {
-    for (Local *l : local_list) delete l;
-  }
   void append_local(Local *l) { local_list.push_back(l); }
   void append_begin(Local *l) { local_list.insert(local_list.begin(), l); }
 
@@ -2457,12 +3130,13 @@ public:
     local_list = l;
     block = b;
   }
-  ~Body() {
-    delete local_list;
-    delete block;
-  }
   virtual void sem() override {
     st.openScope();
+    semOpened();
+  }
+  // The rest of sem, for a program whose scope is open already and whose
+  // locals may be checked.
+  void semOpened(){
     if(st.getSize() > 2){
       std::string parentf = st.getParent();
       if(st.getFormalsFunctionAll(parentf)){
@@ -2477,21 +3151,21 @@ public:
     if(st.getSize() > 2){
       std::string funName;
       funName = st.getParent();
-      std::cout<<funName;
       if(!st.existsResult() && st.isFunction(funName) && !st.isLib(funName)){
-        std::cout << "Function " << funName << " does not have a result\n";
-        exit(1);
+        diag() << "Function " << funName << " does not have a result\n";
+        compile_error();
       }
       if(!st.isemptyForward()){
         std::vector<std::string> v;
         v = st.getForPForward();
-        std::cout << "The following functions or procedures where declared but not implemented\n";
+        diag() << "The following functions or procedures where declared but not implemented\n";
         for(std::string fp : v){
-          std::cout << "\t" << fp << "\n";
+          diag() << "\t" << fp << "\n";
         }
-        exit(1);
+        compile_error();
       }
     }
+    if(st.existsResult()) result = st.lookup("result");
     st.closeScope();
   }
   void merge(Block *b) {
@@ -2512,26 +3186,24 @@ public:
     return s;
   }
   virtual Value* compile() const override {
-    st.openScope();
+    llvm::Type *retTy = Builder.GetInsertBlock()->getParent()->getReturnType();
+    if(result){
+      if(inRegister(result, result->type)) result->ssaType = retTy;
+      else result->val = Builder.CreateAlloca(retTy, 0, "result");
+    }
 
     local_list->compile();
 
     block->compile();
-    if(st.existsResult()){
-
-      Value *retV = st.lookup("result")->v;
-      Builder.CreateRet(retV);
+    if(result && !Builder.GetInsertBlock()->getTerminator()){
+      if(result->ssaType) Builder.CreateRet(TheSSA.read(result, Builder.GetInsertBlock()));
+      else Builder.CreateRet(withTBAA(Builder.CreateLoad(retTy, result->val, "result"), result->type));
     }
-    st.closeScope();
-    // BasicBlock *AfterBB = Builder.GetInsertBlock()->getParent();
     return nullptr;
   }
   virtual Value* compile_r() const override {
-    st.openScope();
-
     local_list->compile_r();
     block->compile_r();
-    st.closeScope();
 
     return nullptr;
   }
@@ -2539,218 +3211,43 @@ public:
 private:
   Local_list *local_list;
   Block *block;
+  // The function's result, if the body assigns one.
+  SymbolEntry *result = nullptr;
 };
 
 
 
 //--------------------------- Library Functions - Procedures -------------------
 
-
-
-class Library{
-public:
-  Library(){};
-  void init(){
-    Formal *formal;
-    Formal_list *formal_list;
-    Id_list *id_list;
-
-    //Output-Input
-
-    //procedure writeInteger (n : integer);
-    formal_list = new Formal_list();
-    id_list = new Id_list();
-
-    id_list->append_idString("n");
-    formal = new Formal(id_list, new Integer(), false);
-    formal_list->append_formal(formal);
-    st.insertProcedureLib("writeInteger", new ProcedureType(), formal_list);
-
-    //procedure writeBoolean (b : boolean);
-    formal_list = new Formal_list();
-    id_list = new Id_list();
-
-    id_list->append_idString("b");
-    formal = new Formal(id_list, new Boolean(), false);
-    formal_list->append_formal(formal);
-    st.insertProcedureLib("writeBoolean", new ProcedureType(), formal_list);
-
-    //procedure writeChar (c : char);
-    formal_list = new Formal_list();
-    id_list = new Id_list();
-
-    id_list->append_idString("c");
-    formal = new Formal(id_list, new Char(), false);
-    formal_list->append_formal(formal);
-    st.insertProcedureLib("writeChar", new ProcedureType(), formal_list);
-
-    //procedure writeReal (r : real);
-    formal_list = new Formal_list();
-    id_list = new Id_list();
-
-    id_list->append_idString("r");
-    formal = new Formal(id_list, new Real(), false);
-    formal_list->append_formal(formal);
-    st.insertProcedureLib("writeReal", new ProcedureType(), formal_list);
-
-    //procedure writeString (var s : array of char);
-    formal_list = new Formal_list();
-    id_list = new Id_list();
-
-    id_list->append_idString("s");
-    formal = new Formal(id_list, new Array(new Char()), true);
-    formal_list->append_formal(formal);
-    st.insertProcedureLib("writeString", new ProcedureType(), formal_list);
-
-    //function readInteger () : integer;
-    formal_list = new Formal_list();
-    st.insertFunctionLib("readInteger", new Integer(), formal_list);
-
-    //function readBoolean () : boolean;
-    formal_list = new Formal_list();
-    st.insertFunctionLib("readBoolean", new Boolean(), formal_list);
-
-    //function readChar () : char;
-    formal_list = new Formal_list();
-    st.insertFunctionLib("readChar", new Char(), formal_list);
-
-    //function readReal () : real;
-    formal_list = new Formal_list();
-    st.insertFunctionLib("readReal", new Real(), formal_list);
-
-    //procedure readString (size : integer; var s : array of char);
-    formal_list = new Formal_list();
-    id_list = new Id_list();
-    id_list->append_idString("s");
-
-    formal = new Formal(id_list, new Integer(), false);
-    formal_list->append_formal(formal);
-    id_list = new Id_list();
-    id_list->append_idString("size");
-    formal = new Formal(id_list, new Array(new Char()), true);
-    formal_list->append_formal(formal);
-    st.insertProcedureLib("readString", new ProcedureType(), formal_list);
-
-    //function abs (n : integer) : integer;
-    formal_list = new Formal_list();
-    id_list = new Id_list();
-
-    id_list->append_idString("n");
-    formal = new Formal(id_list, new Integer(), false);
-    formal_list->append_formal(formal);
-    st.insertFunctionLib("abs", new Integer(), formal_list);
-
-    //function fabs (r : real) : real;
-    formal_list = new Formal_list();
-    id_list = new Id_list();
-
-    id_list->append_idString("r");
-    formal = new Formal(id_list, new Real(), false);
-    formal_list->append_formal(formal);
-    st.insertFunctionLib("fabs", new Real(), formal_list);
-
-    //function sqrt (r : real) : real;
-    formal_list = new Formal_list();
-    id_list = new Id_list();
-
-    id_list->append_idString("r");
-    formal = new Formal(id_list, new Real(), false);
-    formal_list->append_formal(formal);
-    st.insertFunctionLib("sqrt", new Real(), formal_list);
-
-    //function sin (r : real) : real;
-    formal_list = new Formal_list();
-    id_list = new Id_list();
-
-    id_list->append_idString("r");
-    formal = new Formal(id_list, new Real(), false);
-    formal_list->append_formal(formal);
-    st.insertFunctionLib("sin", new Real(), formal_list);
-
-    //function cos (r : real) : real;
-    formal_list = new Formal_list();
-    id_list = new Id_list();
-
-    id_list->append_idString("r");
-    formal = new Formal(id_list, new Real(), false);
-    formal_list->append_formal(formal);
-    st.insertFunctionLib("cos", new Real(), formal_list);
-
-    //function tan (r : real) : real;
-    formal_list = new Formal_list();
-    id_list = new Id_list();
-
-    id_list->append_idString("r");
-    formal = new Formal(id_list, new Real(), false);
-    formal_list->append_formal(formal);
-    st.insertFunctionLib("tan", new Real(), formal_list);
-
-    //function arctan (r : real) : real;
-    formal_list = new Formal_list();
-    id_list = new Id_list();
-
-    id_list->append_idString("r");
-    formal = new Formal(id_list, new Real(), false);
-    formal_list->append_formal(formal);
-    st.insertFunctionLib("arctan", new Real(), formal_list);
-
-    //function exp (r : real) : real;
-    formal_list = new Formal_list();
-    id_list = new Id_list();
-
-    id_list->append_idString("r");
-    formal = new Formal(id_list, new Real(), false);
-    formal_list->append_formal(formal);
-    st.insertFunctionLib("exp", new Real(), formal_list);
-
-    //function ln (r : real) : real;
-    formal_list = new Formal_list();
-    id_list = new Id_list();
-
-    id_list->append_idString("r");
-    formal = new Formal(id_list, new Real(), false);
-    formal_list->append_formal(formal);
-    st.insertFunctionLib("ln", new Real(), formal_list);
-
-    //function pi () : real;
-    formal_list = new Formal_list();
-    st.insertFunctionLib("pi", new Real(), formal_list);
-
-    //function trunc (r : real) : integer;
-    formal_list = new Formal_list();
-    id_list = new Id_list();
-
-    id_list->append_idString("r");
-    formal = new Formal(id_list, new Real(), false);
-    formal_list->append_formal(formal);
-    st.insertFunctionLib("trunc", new Integer(), formal_list);
-
-    //function round (r : real) : integer;
-    formal_list = new Formal_list();
-    id_list = new Id_list();
-
-    id_list->append_idString("r");
-    formal = new Formal(id_list, new Real(), false);
-    formal_list->append_formal(formal);
-    st.insertFunctionLib("round", new Integer(), formal_list);
-
-    //function chr (n : integer) : char;
-    formal_list = new Formal_list();
-    id_list = new Id_list();
-
-    id_list->append_idString("n");
-    formal = new Formal(id_list, new Integer(), false);
-    formal_list->append_formal(formal);
-    st.insertFunctionLib("chr", new Char(), formal_list);
-
-    //function ord (c : char) : integer;
-    formal_list = new Formal_list();
-    id_list = new Id_list();
-
-    id_list->append_idString("c");
-    formal = new Formal(id_list, new Char(), false);
-    formal_list->append_formal(formal);
-    st.insertFunctionLib("ord", new Integer(), formal_list);
-
+inline OurType *builtinType(BuiltinType t){
+  switch(t) {
+    case B_INTEGER: return new Integer();
+    case B_BOOLEAN: return new Boolean();
+    case B_CHAR: return new Char();
+    case B_REAL: return new Real();
+    case B_STRING: return new Array(new Char());
+    default: return new ProcedureType();
   }
-};
+}
+
+inline SymbolTable::Binding *SymbolTable::declareBuiltin(const std::string &c){
+  const Builtin *b = findBuiltin(c.c_str());
+  if(!b || scopes.empty()) return nullptr;
+  Formal_list *formal_list = new Formal_list();
+  for (unsigned i = 0; i < b->arity; i++) {
+    Id_list *id_list = new Id_list();
+    id_list->append_idString(b->params[i].name);
+    formal_list->append_formal(new Formal(id_list, builtinType(b->params[i].type), b->params[i].byRef));
+  }
+  Scope &lib = scopes.front();
+  if(b->result == B_VOID) lib.insertProcedureLib(c, new ProcedureType(), formal_list);
+  else lib.insertFunctionLib(c, builtinType(b->result), formal_list);
+  SymbolEntry *e = lib.lookup(c);
+  e->builtin = b;
+  e->readsMemory = e->writesMemory = !b->pure;
+  e->returns = b->pure;
+  undo.front().push_back(c);
+  std::vector<Binding> &stack = bindings[c];
+  stack.push_back(Binding{ &lib, e });
+  return &stack.back();
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include <cstring>
+
+// The library routines every program sees. They are described by a table
+// compiled into pcl, the symbol table declares one the first time a
+// program names it (see SymbolTable::declareBuiltin) and code generation
+// declares the extern on its first call.
+
+enum BuiltinType { B_VOID, B_INTEGER, B_BOOLEAN, B_CHAR, B_REAL, B_STRING };
+
+struct BuiltinParam {
+  const char *name;
+  BuiltinType type;
+  bool byRef;
+};
+
+struct Builtin {
+  const char *name;
+  BuiltinType result; // B_VOID for procedures
+  unsigned arity;
+  BuiltinParam params[2];
+  bool pure; // no effect but its result: no I/O, no writes through params
+};
+
+constexpr Builtin builtins[] = {
+  // Output-Input
+  { "writeInteger", B_VOID,    1, { { "n", B_INTEGER, false } } },
+  { "writeBoolean", B_VOID,    1, { { "b", B_BOOLEAN, false } } },
+  { "writeChar",    B_VOID,    1, { { "c", B_CHAR, false } } },
+  { "writeReal",    B_VOID,    1, { { "r", B_REAL, false } } },
+  { "writeString",  B_VOID,    1, { { "s", B_STRING, true } } },
+  { "readInteger",  B_INTEGER, 0, { } },
+  { "readBoolean",  B_BOOLEAN, 0, { } },
+  { "readChar",     B_CHAR,    0, { } },
+  { "readReal",     B_REAL,    0, { } },
+  { "readString",   B_VOID,    2, { { "size", B_INTEGER, false }, { "s", B_STRING, true } } },
+  // Mathematical functions
+  { "abs",          B_INTEGER, 1, { { "n", B_INTEGER, false } }, true },
+  { "fabs",         B_REAL,    1, { { "r", B_REAL, false } }, true },
+  { "sqrt",         B_REAL,    1, { { "r", B_REAL, false } }, true },
+  { "sin",          B_REAL,    1, { { "r", B_REAL, false } }, true },
+  { "cos",          B_REAL,    1, { { "r", B_REAL, false } }, true },
+  { "tan",          B_REAL,    1, { { "r", B_REAL, false } }, true },
+  { "arctan",       B_REAL,    1, { { "r", B_REAL, false } }, true },
+  { "exp",          B_REAL,    1, { { "r", B_REAL, false } }, true },
+  { "ln",           B_REAL,    1, { { "r", B_REAL, false } }, true },
+  { "pi",           B_REAL,    0, { }, true },
+  // Conversion functions
+  { "trunc",        B_INTEGER, 1, { { "r", B_REAL, false } }, true },
+  { "round",        B_INTEGER, 1, { { "r", B_REAL, false } }, true },
+  { "chr",          B_CHAR,    1, { { "n", B_INTEGER, false } }, true },
+  { "ord",          B_INTEGER, 1, { { "c", B_CHAR, false } }, true },
+};
+
+inline const Builtin *findBuiltin(const char *name) {
+  for (const Builtin &b : builtins) {
+    if (strcmp(b.name, name) == 0) return &b;
+  }
+  return nullptr;
+}
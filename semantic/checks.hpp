@@ -0,0 +1,100 @@
+#pragma once
+#include <map>
+#include <llvm/IR/Intrinsics.h>
+#include <llvm/IR/MDBuilder.h>
+#include "ssa.hpp"
+
+// --check-overflow: integer +, -, *, div and mod trap instead of wrapping.
+// Each operation computes its overflow bit with the llvm.*.with.overflow
+// intrinsics (or compares for div and mod) and branches, as unlikely, to
+// one cold block per function that calls __pcl_arith_error (runtime/trap.c)
+// with the line and kind of the failing operation. The arithmetic itself
+// stays visible to the optimizer, which drops the checks it proves cannot
+// fail (instcombine, correlated value propagation).
+class OverflowChecks {
+public:
+  enum Kind { OVERFLOW = 0, DIVISION_BY_ZERO = 1 };
+
+  void clear() { traps.clear(); }
+
+  llvm::Value *add(llvm::Value *l, llvm::Value *r, int line) {
+    return arithmetic(llvm::Intrinsic::sadd_with_overflow, l, r, line);
+  }
+  llvm::Value *sub(llvm::Value *l, llvm::Value *r, int line) {
+    return arithmetic(llvm::Intrinsic::ssub_with_overflow, l, r, line);
+  }
+  llvm::Value *mul(llvm::Value *l, llvm::Value *r, int line) {
+    return arithmetic(llvm::Intrinsic::smul_with_overflow, l, r, line);
+  }
+  llvm::Value *divide(llvm::Value *l, llvm::Value *r, bool remainder, int line) {
+    llvm::IRBuilder<> &B = AST::Builder;
+    llvm::Type *ty = l->getType();
+    unsigned bits = ty->getIntegerBitWidth();
+    check(B.CreateICmpEQ(r, llvm::ConstantInt::get(ty, 0)), line, DIVISION_BY_ZERO);
+    // The one quotient that does not fit: the smallest integer by -1.
+    check(B.CreateAnd(
+              B.CreateICmpEQ(l, llvm::ConstantInt::get(ty, llvm::APInt::getSignedMinValue(bits))),
+              B.CreateICmpEQ(r, llvm::ConstantInt::getSigned(ty, -1))),
+          line, OVERFLOW);
+    return remainder ? B.CreateSRem(l, r, "modtmp") : B.CreateSDiv(l, r, "divtmp");
+  }
+
+private:
+  struct Trap {
+    llvm::BasicBlock *block = nullptr;
+    llvm::PHINode *line = nullptr, *kind = nullptr;
+  };
+
+  llvm::Value *arithmetic(llvm::Intrinsic::ID id, llvm::Value *l, llvm::Value *r, int line) {
+    llvm::IRBuilder<> &B = AST::Builder;
+    llvm::Function *f = llvm::Intrinsic::getDeclaration(
+        AST::TheModule.get(), id, std::vector<llvm::Type *> { l->getType() });
+    llvm::Value *pair = B.CreateCall(f, std::vector<llvm::Value *> { l, r });
+    llvm::Value *value = B.CreateExtractValue(pair, 0);
+    check(B.CreateExtractValue(pair, 1), line, OVERFLOW);
+    return value;
+  }
+
+  // Continues in a new block when failed is false.
+  void check(llvm::Value *failed, int line, Kind kind) {
+    llvm::ConstantInt *known = llvm::dyn_cast<llvm::ConstantInt>(failed);
+    if (known && known->isZero()) return;
+    llvm::IRBuilder<> &B = AST::Builder;
+    llvm::BasicBlock *here = B.GetInsertBlock();
+    Trap &trap = trapOf(here->getParent());
+    llvm::BasicBlock *ok = llvm::BasicBlock::Create(AST::TheContext, "ok", here->getParent());
+    llvm::MDBuilder mdb(AST::TheContext);
+    B.CreateCondBr(failed, trap.block, ok, mdb.createBranchWeights(1, 1 << 20));
+    trap.line->addIncoming(llvm::ConstantInt::get(AST::i32, line), here);
+    trap.kind->addIncoming(llvm::ConstantInt::get(AST::i32, kind), here);
+    B.SetInsertPoint(ok);
+    TheSSA.seal(ok);
+  }
+
+  Trap &trapOf(llvm::Function *f) {
+    Trap &trap = traps[f];
+    if (trap.block) return trap;
+    llvm::LLVMContext &C = AST::TheContext;
+    llvm::Function *error = AST::TheModule->getFunction("__pcl_arith_error");
+    if (!error) {
+      error = llvm::Function::Create(
+          llvm::FunctionType::get(llvm::Type::getVoidTy(C),
+                                  std::vector<llvm::Type *> { AST::i32, AST::i32 }, false),
+          llvm::Function::ExternalLinkage, "__pcl_arith_error", AST::TheModule.get());
+      error->setDoesNotReturn();
+      error->setDoesNotThrow();
+      error->addFnAttr(llvm::Attribute::Cold);
+    }
+    trap.block = llvm::BasicBlock::Create(C, "arith.error", f);
+    llvm::IRBuilder<> B(trap.block);
+    trap.line = B.CreatePHI(AST::i32, 4, "line");
+    trap.kind = B.CreatePHI(AST::i32, 4, "kind");
+    B.CreateCall(error, std::vector<llvm::Value *> { trap.line, trap.kind })->setDoesNotReturn();
+    B.CreateUnreachable();
+    return trap;
+  }
+
+  std::map<llvm::Function *, Trap> traps;
+};
+
+extern thread_local OverflowChecks TheChecks;
@@ -0,0 +1,52 @@
+#pragma once
+#include <exception>
+#include <iostream>
+#include <vector>
+
+// Thrown instead of exiting when the program being compiled is wrong, so a
+// compiler that stays up (pcl --server) can report it and go on.
+class CompileError: public std::exception {
+public:
+  CompileError(int l = 0): line(l) {}
+  virtual const char *what() const noexcept override { return "compile error"; }
+  int line; // of the error, 0 when not known
+};
+
+// Where error messages go: std::cout unless the driver redirects them.
+extern thread_local std::ostream *TheDiagnostics;
+inline std::ostream &diag() { return *TheDiagnostics; }
+
+// Points diag() at one compile's stream for as long as it is in scope.
+struct DiagnosticsScope {
+  std::ostream *previous;
+  DiagnosticsScope(std::ostream &diagnostics) : previous(TheDiagnostics) {
+    TheDiagnostics = &diagnostics;
+  }
+  ~DiagnosticsScope() { TheDiagnostics = previous; }
+};
+
+// The line of the statement or declaration sem is checking, 0 when there is
+// none: compile_error reports it when it is not given a line.
+extern thread_local int TheCheckedLine;
+struct LineScope {
+  int previous;
+  LineScope(int line) : previous(TheCheckedLine) {
+    if (line) TheCheckedLine = line;
+  }
+  ~LineScope() { TheCheckedLine = previous; }
+};
+
+// Where the messages written to diag() end, for a driver that reports them
+// one by one (libpcl); compile_error ends one.
+struct MessageEnd {
+  std::streamoff offset;
+  int line;
+};
+extern thread_local std::vector<MessageEnd> *TheMessageEnds;
+
+[[noreturn]] inline void compile_error(int line = 0) {
+  diag().flush();
+  if (!line) line = TheCheckedLine;
+  if (TheMessageEnds) TheMessageEnds->push_back(MessageEnd{ diag().tellp(), line });
+  throw CompileError(line);
+}
@@ -0,0 +1,37 @@
+#pragma once
+#include <string>
+
+// Command line options of pcl that change how a program is compiled.
+struct Options {
+  // --profile-generate: instrument every function with edge counters and
+  // write a raw profile (default.profraw) when the program exits.
+  bool profileGenerate = false;
+  // --profile-use=file: indexed profile (llvm-profdata merge output) whose
+  // counts become branch weights, entry counts and inlining hints.
+  std::string profileUse;
+  // --profile-procedures: count calls and rdtsc cycles of every routine,
+  // runtime/profile.c prints a flat profile and call graph at exit.
+  bool profileProcedures = false;
+  // --profile-sample: keep frame pointers, mark where every statement starts
+  // and register the routines with the SIGPROF sampler of runtime/sampler.c,
+  // which writes folded stacks down to the line.
+  bool profileSample = false;
+  // --check-overflow: integer +, -, *, div and mod stop the program with
+  // the source line when they overflow or divide by zero.
+  bool checkOverflow = false;
+  // --report-dead: list on stderr the routines dropped because the main
+  // block never reaches them.
+  bool reportDead = false;
+  // --report-escape: list on stderr the objects of new that escape analysis
+  // put in their routine's stack frame.
+  bool reportEscape = false;
+  // --cache=dir: keep the module of every compiled program in dir and load
+  // it from there when the same program is compiled again.
+  std::string cacheDir;
+  // --veclib=name: vectorize the loops of the program for the host before
+  // it is written, calling the vector math routines of the named library
+  // (SVML, LIBMVEC, MASSV, Accelerate) for sin, cos, exp, ln, tan, arctan.
+  std::string vecLib;
+};
+
+extern thread_local Options opts;
@@ -0,0 +1,104 @@
+#pragma once
+#include <map>
+#include <set>
+#include <vector>
+#include <llvm/IR/BasicBlock.h>
+#include <llvm/IR/CFG.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/Instructions.h>
+#include "symbol.hpp"
+
+// SSA construction for the scalar variables that never need memory, as in
+// Braun et al., "Simple and Efficient Construction of Static Single
+// Assignment Form". An assignment records the value per basic block, a read
+// looks it up through the predecessors and places a phi where paths merge.
+// Until a block is sealed more predecessors may be added to it, a read there
+// gets an empty phi that is filled in by seal(). Entry blocks are sealed
+// from the start.
+class SSABuilder {
+public:
+  // Blocks are per module, the state goes with it.
+  void clear() {
+    defs.clear();
+    incomplete.clear();
+    sealed.clear();
+  }
+  void write(SymbolEntry *var, llvm::BasicBlock *block, llvm::Value *value) {
+    defs[var][block] = value;
+  }
+  llvm::Value *read(SymbolEntry *var, llvm::BasicBlock *block) {
+    std::map<llvm::BasicBlock *, llvm::Value *> &d = defs[var];
+    std::map<llvm::BasicBlock *, llvm::Value *>::iterator it = d.find(block);
+    if (it != d.end()) return it->second;
+    return readRecursive(var, block);
+  }
+  // Every predecessor of block has been emitted.
+  void seal(llvm::BasicBlock *block) {
+    std::vector<std::pair<SymbolEntry *, llvm::PHINode *>> phis;
+    phis.swap(incomplete[block]);
+    incomplete.erase(block);
+    sealed.insert(block);
+    for (std::pair<SymbolEntry *, llvm::PHINode *> &p : phis) addOperands(p.first, p.second);
+  }
+
+private:
+  bool isSealed(llvm::BasicBlock *block) const {
+    return sealed.count(block) || block == &block->getParent()->getEntryBlock();
+  }
+  llvm::PHINode *newPhi(SymbolEntry *var, llvm::BasicBlock *block) {
+    if (block->empty()) return llvm::PHINode::Create(var->ssaType, 2, var->s, block);
+    return llvm::PHINode::Create(var->ssaType, 2, var->s, &block->front());
+  }
+  llvm::Value *readRecursive(SymbolEntry *var, llvm::BasicBlock *block) {
+    llvm::Value *value;
+    if (!isSealed(block)) {
+      llvm::PHINode *phi = newPhi(var, block);
+      incomplete[block].push_back(std::make_pair(var, phi));
+      value = phi;
+    }
+    else if (llvm::BasicBlock *pred = block->getSinglePredecessor()) {
+      value = read(var, pred);
+    }
+    else if (llvm::pred_begin(block) == llvm::pred_end(block)) {
+      // Read before any assignment.
+      value = llvm::UndefValue::get(var->ssaType);
+    }
+    else {
+      // Recorded first, a loop back to this block finds the phi.
+      llvm::PHINode *phi = newPhi(var, block);
+      write(var, block, phi);
+      value = addOperands(var, phi);
+    }
+    write(var, block, value);
+    return value;
+  }
+  llvm::Value *addOperands(SymbolEntry *var, llvm::PHINode *phi) {
+    llvm::BasicBlock *block = phi->getParent();
+    for (llvm::BasicBlock *pred : llvm::predecessors(block))
+      phi->addIncoming(read(var, pred), pred);
+    return removeTrivial(var, phi);
+  }
+  // A phi whose operands are all one value (or itself) is that value.
+  llvm::Value *removeTrivial(SymbolEntry *var, llvm::PHINode *phi) {
+    llvm::Value *same = nullptr;
+    for (llvm::Value *op : phi->incoming_values()) {
+      if (op == same || op == phi) continue;
+      if (same) return phi;
+      same = op;
+    }
+    if (!same) same = llvm::UndefValue::get(phi->getType());
+    phi->replaceAllUsesWith(same);
+    for (std::pair<llvm::BasicBlock *const, llvm::Value *> &d : defs[var]) {
+      if (d.second == phi) d.second = same;
+    }
+    phi->eraseFromParent();
+    return same;
+  }
+
+  std::map<SymbolEntry *, std::map<llvm::BasicBlock *, llvm::Value *>> defs;
+  std::map<llvm::BasicBlock *, std::vector<std::pair<SymbolEntry *, llvm::PHINode *>>> incomplete;
+  std::set<llvm::BasicBlock *> sealed;
+};
+
+extern thread_local SSABuilder TheSSA;
@@ -0,0 +1,79 @@
+#pragma once
+#include <cstring>
+#include <map>
+#include <string>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/GlobalVariable.h>
+
+// The string literals of a module. Each distinct text is one private
+// unnamed_addr constant, however often the program writes it, NUL
+// terminated for the routines that look for the end. The length of every
+// literal is known here, writeString of a literal passes it to
+// __pcl_write_string_n (runtime/output.c) instead of making the runtime
+// scan for it.
+class StringPool {
+public:
+  // Globals are per module, the pool goes with it.
+  void clear() {
+    byText.clear();
+    lengths.clear();
+  }
+  // The first character of text, in the pool.
+  llvm::Constant *get(const std::string &text) {
+    std::map<std::string, llvm::Constant *>::iterator it = byText.find(text);
+    if (it != byText.end()) return it->second;
+    llvm::Constant *data = llvm::ConstantDataArray::getString(AST::TheContext, text);
+    llvm::GlobalVariable *gv = new llvm::GlobalVariable(
+        *AST::TheModule, data->getType(), true, llvm::GlobalValue::PrivateLinkage, data, "str");
+    gv->setUnnamedAddr(llvm::GlobalValue::UnnamedAddr::Global);
+    gv->setAlignment(1);
+    llvm::Constant *zero = llvm::ConstantInt::get(AST::i32, 0);
+    llvm::Constant *first = llvm::ConstantExpr::getInBoundsGetElementPtr(
+        data->getType(), gv, std::vector<llvm::Constant *> { zero, zero });
+    byText[text] = first;
+    // What a scan for the NUL would find.
+    lengths[first] = text.find('\0') == std::string::npos ? text.size() : text.find('\0');
+    return first;
+  }
+  // The first character of a writable copy of text, for a literal that is
+  // assigned to ("abc"[0] := 'x'). Every such literal has its own.
+  llvm::Constant *copy(const std::string &text) {
+    llvm::Constant *data = llvm::ConstantDataArray::getString(AST::TheContext, text);
+    llvm::GlobalVariable *gv = new llvm::GlobalVariable(
+        *AST::TheModule, data->getType(), false, llvm::GlobalValue::PrivateLinkage, data, "str.copy");
+    llvm::Constant *zero = llvm::ConstantInt::get(AST::i32, 0);
+    return llvm::ConstantExpr::getInBoundsGetElementPtr(
+        data->getType(), gv, std::vector<llvm::Constant *> { zero, zero });
+  }
+  // The length of a pooled literal, -1 for any other string.
+  long long lengthOf(llvm::Value *v) const {
+    std::map<llvm::Value *, size_t>::const_iterator it = lengths.find(v);
+    return it == lengths.end() ? -1 : (long long)it->second;
+  }
+  // The characters of a literal as the scanner gives it, quotes and
+  // escape sequences included.
+  static std::string decode(const char *literal) {
+    std::string text;
+    size_t n = strlen(literal);
+    for (size_t i = 1; i + 1 < n; i++) {
+      char c = literal[i];
+      if (c == '\\' && i + 2 < n) {
+        switch (literal[++i]) {
+        case 'n': c = '\n'; break;
+        case 't': c = '\t'; break;
+        case 'r': c = '\r'; break;
+        case '0': c = '\0'; break;
+        default: c = literal[i]; // \' \" and \\ stand for themselves
+        }
+      }
+      text += c;
+    }
+    return text;
+  }
+
+private:
+  std::map<std::string, llvm::Constant *> byText;
+  std::map<llvm::Value *, size_t> lengths;
+};
+
+extern thread_local StringPool TheStrings;
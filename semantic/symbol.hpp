@@ -2,17 +2,70 @@
 #include <iostream>
 #include <cstdlib>
 #include <vector>
+#include <deque>
 #include <map>
+#include <unordered_map>
 #include "OurType.hpp"
+#include "builtins.hpp"
 
 
+// Entries outlive their scope, semantic analysis leaves pointers to them on
+// the AST nodes that resolved to them and code generation fills in the llvm
+// values through those pointers. The SymbolTable owns them all and frees
+// them when it is replaced by a new one for the next program.
+class Formal_list;
 struct SymbolEntry {
-  OurType *type;
+  OurType *type = nullptr;
   int offset;
   std::string s;
-  AllocaInst* val;
-  Value* v;
-  Function* f;
+  Value* val = nullptr; // where a variable is kept: a stack slot, or a global in the main program
+  Value* v = nullptr;
+  Function* f = nullptr;
+  const Builtin *builtin = nullptr; // set for library routines
+  // Routines only: the routines their body calls, and whether the main
+  // block reaches them (see SymbolTable::markReachable).
+  std::vector<SymbolEntry *> calls;
+  bool reachable = false;
+  Formal_list *formals = nullptr; // routines of the program, set by sem
+  // Variables: the routine declaring them (nullptr in the main program) and
+  // whether they need memory, because @ takes their address, they are
+  // passed by reference or a nested routine uses them. Set by sem.
+  SymbolEntry *owner = nullptr;
+  bool addressTaken = false;
+  bool byRef = false; // a var formal, the caller's memory
+  // Routines: what the body does besides computing its result, as sem saw
+  // it, then with what it calls folded in (SymbolTable::inferEffects).
+  bool readsMemory = false;
+  bool writesMemory = false;
+  bool mayLoop = false; // while or goto
+  bool returns = false; // always returns: no loops, no recursion
+  // Touches memory that is neither its own variables nor reached through
+  // its parameters: a variable of the main program or of an enclosing
+  // routine, or an object through a pointer.
+  bool reachesShared = false;
+  // Set by code generation for the variables kept in registers (ssa.hpp).
+  llvm::Type *ssaType = nullptr;
+  // Pointer variables: how often sem saw the pointer, and how many of those
+  // uses only reach its object (p^, new p, dispose p, an assignment to p).
+  // When a var is used for nothing else its pointer never escapes, and its
+  // objects may live in its routine's frame (SymbolTable::placeAllocations).
+  int pointerUses = 0;
+  int objectUses = 0;
+  bool local = false;   // declared by var, not a formal
+  bool onStack = false; // every new of it is in the frame
+  // Array formals are passed as their first element (v) and element count
+  // (length, an i32), see Header::bindArguments. written: an assignment
+  // stores into the variable or one of its elements.
+  Value *length = nullptr;
+  bool written = false;
+  // Routines: the variables of enclosing routines they use, themselves or
+  // through the routines they call (SymbolTable::closeCaptures). Each one is
+  // passed as an extra parameter holding its address, or its first element
+  // and length for an array formal.
+  std::vector<SymbolEntry *> captures;
+  // Variables: the parameters standing for them in the functions of the
+  // routines that capture them (Header::bindArguments).
+  std::map<Function *, std::pair<Value *, Value *>> capturedIn;
 
   SymbolEntry() {}
   SymbolEntry(OurType *t, int ofs, std::string c) : type(t), offset(ofs), s(c){}
@@ -21,25 +74,25 @@ struct SymbolEntry {
   SymbolEntry(int ofs, std::string c, Function *v) : offset(ofs), s(c), f(v) {}
 };
 
-class Formal_list;
 class Stmt;
 class Scope {
 public:
   Scope() : locals(), offset(-1), size(0) {}
-  Scope(int ofs) : locals(), offset(ofs), size(0) {}
+  Scope(int ofs, std::deque<SymbolEntry> *a) : locals(), arena(a), offset(ofs), size(0) {}
   int getOffset() const { return offset; }
   int getSize() const { return size; }
   SymbolEntry *lookup(std::string c) {
-    if (locals.find(c) == locals.end()) return nullptr;
-    return &(locals[c]);
+    auto it = locals.find(c);
+    if (it == locals.end()) return nullptr;
+    return it->second;
   }
   void insert(std::string c, OurType *t) {
     if (locals.find(c) != locals.end()) {
       print();
-      std::cerr << "Duplicate variable " << c << std::endl;
-      exit(1);
+      diag() << "Duplicate variable " << c << std::endl;
+      compile_error();
     }
-    locals[c] = SymbolEntry(t, offset++, c);
+    locals[c] = make(t, offset++, c);
     ++size;
     procedures[c] = false;
     procedureFormals[c] = nullptr;
@@ -50,10 +103,10 @@ public:
   void insert(std::string c, OurType *t, AllocaInst *v) {
     if (locals.find(c) != locals.end()) {
       print();
-      std::cerr << "Duplicate variable " << c << std::endl;
-      exit(1);
+      diag() << "Duplicate variable " << c << std::endl;
+      compile_error();
     }
-    locals[c] = SymbolEntry(t, offset++, c, v);
+    locals[c] = make(t, offset++, c, v);
     ++size;
     procedures[c] = false;
     procedureFormals[c] = nullptr;
@@ -64,10 +117,10 @@ public:
   void insert(std::string c, Function *v) {
     if (locals.find(c) != locals.end()) {
       print();
-      std::cerr << "Duplicate function " << c << std::endl;
-      exit(1);
+      diag() << "Duplicate function " << c << std::endl;
+      compile_error();
     }
-    locals[c] = SymbolEntry(offset++, c, v);
+    locals[c] = make(offset++, c, v);
     ++size;
     procedures[c] = false;
     procedureFormals[c] = nullptr;
@@ -78,10 +131,10 @@ public:
   void insert(std::string c, OurType *t, Value* v) {
     if (locals.find(c) != locals.end()) {
       print();
-      std::cerr << "Duplicate variable " << c << std::endl;
-      exit(1);
+      diag() << "Duplicate variable " << c << std::endl;
+      compile_error();
     }
-    locals[c] = SymbolEntry(t, offset++, c, v);
+    locals[c] = make(t, offset++, c, v);
     ++size;
     procedures[c] = false;
     procedureFormals[c] = nullptr;
@@ -92,10 +145,10 @@ public:
   void insertLabel(std::string c, OurType *t) {
     if (locals.find(c) != locals.end()) {
       print();
-      std::cerr << "Duplicate variable " << c << "insertLabel" << std::endl;
-      exit(1);
+      diag() << "Duplicate variable " << c << "insertLabel" << std::endl;
+      compile_error();
     }
-    locals[c] = SymbolEntry(t, offset++, c);
+    locals[c] = make(t, offset++, c);
     ++size;
     procedures[c] = false;
     procedureFormals[c] = nullptr;
@@ -108,10 +161,10 @@ public:
   }
   void insertProcedure(std::string c, OurType *t, Formal_list *f) {
     if (locals.find(c) != locals.end()) {
-      std::cerr << "Duplicate variable " << c << "insertProcedure" << std::endl;
-      exit(1);
+      diag() << "Duplicate variable " << c << "insertProcedure" << std::endl;
+      compile_error();
     }
-    locals[c] = SymbolEntry(t, offset++, c);
+    locals[c] = make(t, offset++, c);
     ++size;
     procedures[c] = true;
     procedureFormals[c] = f;
@@ -127,10 +180,10 @@ public:
   }
   void insertFunction(std::string c, OurType *t, Formal_list *f) {
     if (locals.find(c) != locals.end()) {
-      std::cerr << "Duplicate variable " << c << "insertFunction" << std::endl;
-      exit(1);
+      diag() << "Duplicate variable " << c << "insertFunction" << std::endl;
+      compile_error();
     }
-    locals[c] = SymbolEntry(t, offset++, c);
+    locals[c] = make(t, offset++, c);
     ++size;
     functions[c] = true;
     functionFormals[c] = f;
@@ -138,9 +191,9 @@ public:
     localForPQueue.push_back(c);
   }
   void printParents(){
-    std::cout << "Parents\n";
+    diag() << "Parents\n";
     for(std::string s : localForPQueue){
-      std::cout << "\t" << s <<"\n";
+      diag() << "\t" << s <<"\n";
     }
   }
   Formal_list *getFormalsProcedure(std::string c){
@@ -153,17 +206,17 @@ public:
     return functions[c];
   }
   void print(){
-    std::cout<< std::endl;
+    diag()<< std::endl;
     for(auto it = locals.cbegin(); it != locals.cend(); ++it)
     {
       if(isProcedure(it->first)){
-        std::cout << "\t" << it->first << ": " << it->second.type->val << " (is a procedure) \n";
+        diag() << "\t" << it->first << ": " << it->second->type->val << " (is a procedure) \n";
       }
       else if(isFunction(it->first)){
-        std::cout << "\t" << it->first << ": " << it->second.type->val << " (is a function) \n";
+        diag() << "\t" << it->first << ": " << it->second->type->val << " (is a function) \n";
       }
       else{
-        std::cout << "\t" << it->first << ": " << it->second.type->val << "(is a variable) \n";
+        diag() << "\t" << it->first << ": " << it->second->type->val << "(is a variable) \n";
       }
     }
   }
@@ -172,16 +225,19 @@ public:
       return localForPQueue.back();
     }
     else{
-      std::cout << "Cant find parrent function!";
-      exit(1);
+      diag() << "Cant find parrent function!";
+      compile_error();
     }
   }
-  void makeNew(std::string c){
-    isNewV[c] = true;
+  void makeNew(AST *lval){
+    isNewV.emplace(lval->fingerprint(), lval);
   }
-  bool isNew(std::string c){
-    if (isNewV.find(c) == isNewV.end()) return false;
-    return true;
+  bool isNew(AST *lval){
+    auto range = isNewV.equal_range(lval->fingerprint());
+    for (auto it = range.first; it != range.second; ++it) {
+      if (it->second->sameAs(lval)) return true;
+    }
+    return false;
   }
   void insertProcedureForward(std::string c, OurType *t, Formal_list *f){ insertProcedure(c, t, f); isForwardV[c] = true; }
   void insertFunctionForward(std::string c, OurType *t, Formal_list *f){ insertFunction(c, t, f); isForwardV[c] = true; }
@@ -226,9 +282,10 @@ public:
     return true;
   }
 private:
-  std::map<std::string , SymbolEntry> locals;
+  std::map<std::string , SymbolEntry *> locals;
   std::vector<std::string> localForPQueue;
-  std::map<std::string, bool> isNewV;
+  // l-values given to new, by fingerprint.
+  std::unordered_multimap<uint64_t, AST *> isNewV;
   std::map<std::string, bool> isForwardV;
   std::map<std::string, bool> isLibV;
   std::map<std::string , bool> procedures;
@@ -237,27 +294,42 @@ private:
   std::map<std::string , Formal_list *> functionFormals;
   std::map<std::string , bool> label;
   std::map<std::string , Stmt *> labelStmt;
+  std::deque<SymbolEntry> *arena = nullptr; // the table's, never moves an entry
+
+  template <typename... Args> SymbolEntry *make(Args &&...args) {
+    arena->emplace_back(std::forward<Args>(args)...);
+    return &arena->back();
+  }
 
   int offset;
   int size;
 };
 
+// Every name maps to the stack of its bindings, innermost last, so resolving
+// a name costs the same at any nesting depth. Each scope keeps an undo log
+// of the names it bound and closeScope pops exactly those.
 class SymbolTable {
 public:
   void openScope() {
     int ofs = scopes.empty() ? 0 : scopes.back().getOffset();
-    scopes.push_back(Scope(ofs));
-  }
-  void closeScope() { scopes.pop_back(); };
+    scopes.push_back(Scope(ofs, &entries));
+    undo.push_back(std::vector<std::string>());
+  }
+  void closeScope() {
+    for (const std::string &c : undo.back()) {
+      auto it = bindings.find(c);
+      it->second.pop_back();
+      if (it->second.empty()) bindings.erase(it);
+    }
+    undo.pop_back();
+    scopes.pop_back();
+  };
 
   SymbolEntry *lookup(std::string c) {
-    SymbolEntry *e;
-    for (auto i = scopes.rbegin(); i != scopes.rend(); ++i) {
-        e = i->lookup(c);
-        if(e) return e;
-    }
-    std::cerr << "Unknown variable " << c << std::endl;
-    exit(1);
+    Binding *b = innermost(c);
+    if(b) return b->entry;
+    diag() << "Unknown variable " << c << std::endl;
+    compile_error();
   }
 
   bool existsResult(){
@@ -277,13 +349,9 @@ public:
     return 0;
   }
   bool existsGlobal(std::string c){
-    SymbolEntry *e;
-    for (auto i = scopes.rbegin(); i != scopes.rend(); ++i) {
-        e = i->lookup(c);
-        if(e) return true;
-    }
-    std::cerr << "Unknown variable (searched Global)" << c << std::endl;
-    exit(1);
+    if(innermost(c)) return true;
+    diag() << "Unknown variable (searched Global)" << c << std::endl;
+    compile_error();
   }
 
   SymbolEntry *getSymbolEntry(std::string c){
@@ -294,69 +362,54 @@ public:
   void printScopes(){
     int k = 0;
     for (auto i = scopes.rbegin(); i != scopes.rend(); ++i) {
-      std::cout << "Printing Scope " << k << "\n";
+      diag() << "Printing Scope " << k << "\n";
       i->print();
       k++;
     }
   }
   Formal_list *getFormalsProcedureAll(std::string c){
-    for (auto i = scopes.rbegin(); i != scopes.rend(); ++i) {
-      if(i->getFormalsProcedure(c)){
-              return i->getFormalsProcedure(c);
-      }
-    }
-    return nullptr;
+    Binding *b = innermost(c);
+    return b ? b->scope->getFormalsProcedure(c) : nullptr;
   }
   Formal_list *getFormalsFunctionAll(std::string c){
-    for (auto i = scopes.rbegin(); i != scopes.rend(); ++i) {
-      if(i->getFormalsFunction(c)){
-              return i->getFormalsFunction(c);
-      }
-    }
-    return nullptr;
+    Binding *b = innermost(c);
+    return b ? b->scope->getFormalsFunction(c) : nullptr;
   }
   void printLastScope(){
-    std::cout << "Printing Scope \n";
+    diag() << "Printing Scope \n";
     scopes.back().print();
   }
   int getSizeOfCurrentScope() const { return scopes.back().getSize(); }
-  void insert(std::string c, OurType *t) { scopes.back().insert(c, t); }
-  void insert(std::string c, OurType *t, AllocaInst *v) { scopes.back().insert(c, t, v); }
-  void insert(std::string c, OurType *t, Value *v) { scopes.back().insert(c, t, v); }
-  void insert(std::string c, Function *v) { scopes.back().insert(c, v); functionFirst = 0;}
+  void insert(std::string c, OurType *t) { scopes.back().insert(c, t); bind(c); }
+  void insert(std::string c, OurType *t, AllocaInst *v) { scopes.back().insert(c, t, v); bind(c); }
+  void insert(std::string c, OurType *t, Value *v) { scopes.back().insert(c, t, v); bind(c); }
+  void insert(std::string c, Function *v) { scopes.back().insert(c, v); bind(c); functionFirst = 0;}
 
   bool isProcedure(std::string s){
-    for (auto i = scopes.rbegin(); i != scopes.rend(); ++i) {
-      if(i->exists(s)) return i->isProcedure(s);
-    }
-    return false;
+    Binding *b = innermost(s);
+    return b ? b->scope->isProcedure(s) : false;
   }
-  void insertLabel(std::string c, OurType *t) { scopes.back().insertLabel(c, t); }
-  void insertProcedure(std::string c, OurType *t, Formal_list *f) { scopes.back().insertProcedure(c, t, f); }
+  void insertLabel(std::string c, OurType *t) { scopes.back().insertLabel(c, t); bind(c); }
+  void insertProcedure(std::string c, OurType *t, Formal_list *f) { scopes.back().insertProcedure(c, t, f); bind(c); }
   bool isFunction(std::string s){
-    for (auto i = scopes.rbegin(); i != scopes.rend(); ++i) {
-      if(i->exists(s)) return i->isFunction(s);
-    }
-    return false;
+    Binding *b = innermost(s);
+    return b ? b->scope->isFunction(s) : false;
   }
   bool isLib(std::string s){
-    for (auto i = scopes.rbegin(); i != scopes.rend(); ++i) {
-      if(i->exists(s)) return i->isLib(s);
-    }
-    return false;
+    Binding *b = innermost(s);
+    return b ? b->scope->isLib(s) : false;
   }
-  void insertProcedureForward(std::string c, OurType *t, Formal_list *f){ scopes.back().insertProcedureForward(c, t, f); }
-  void insertFunctionForward(std::string c, OurType *t, Formal_list *f){ scopes.back().insertFunctionForward(c, t, f); }
-  void insertForward(std::string c, OurType *t){ scopes.back().insertForward(c, t); }
+  void insertProcedureForward(std::string c, OurType *t, Formal_list *f){ scopes.back().insertProcedureForward(c, t, f); bind(c); }
+  void insertFunctionForward(std::string c, OurType *t, Formal_list *f){ scopes.back().insertFunctionForward(c, t, f); bind(c); }
+  void insertForward(std::string c, OurType *t){ scopes.back().insertForward(c, t); bind(c); }
 
-  void insertFunction(std::string c, OurType *t, Formal_list *f) { scopes.back().insertFunction(c, t, f); }
-  void insertFunctionLib(std::string c, OurType *t, Formal_list *f) { scopes.back().insertFunctionLib(c, t, f); }
-  void insertProcedureLib(std::string c, OurType *t, Formal_list *f){ scopes.back().insertProcedureLib(c, t, f); }
+  void insertFunction(std::string c, OurType *t, Formal_list *f) { scopes.back().insertFunction(c, t, f); bind(c); }
+  void insertFunctionLib(std::string c, OurType *t, Formal_list *f) { scopes.back().insertFunctionLib(c, t, f); bind(c); }
+  void insertProcedureLib(std::string c, OurType *t, Formal_list *f){ scopes.back().insertProcedureLib(c, t, f); bind(c); }
 
 
   std::string getParent(){
     std::string s;
-    std::cout<<scopes.size();
     if(scopes.size() == 1){
       s = scopes.back().getParentFunction();
       return s;
@@ -366,8 +419,8 @@ public:
       return s;
     }
     else{
-      std::cout << "Cant find parent function\n";
-      exit(1);
+      diag() << "Cant find parent function\n";
+      compile_error();
     }
   }
   Formal_list *getFormalsProcedure(std::string c){
@@ -376,11 +429,11 @@ public:
   Formal_list *getFormalsFunction(std::string c){
     return scopes.back().getFormalsFunction(c);
   }
-  void makeNew(std::string c){
-    scopes.back().makeNew(c);
+  void makeNew(AST *lval){
+    scopes.back().makeNew(lval);
   }
-  bool isNew(std::string c){
-    return scopes.back().isNew(c);
+  bool isNew(AST *lval){
+    return scopes.back().isNew(lval);
   }
   bool isLabel(std::string c){
     return scopes.back().isLabel(c);
@@ -406,7 +459,7 @@ public:
   void printParents(){
     int k = 0;
     for (auto i = scopes.rbegin(); i != scopes.rend(); ++i) {
-      std::cout << "Printing Parents for Scope " << k << "\n";
+      diag() << "Printing Parents for Scope " << k << "\n";
       i->printParents();
       k++;
     }
@@ -415,19 +468,165 @@ public:
     findScopeToinsert(s);
   }
   void findScopeToinsert(std::string s){
-    for (auto i = scopes.rbegin(); i != scopes.rend(); ++i) {
-      if(i->exists(s)) i->insertParent(s); return;
+    Binding *b = innermost(s);
+    if(b){
+      b->scope->insertParent(s);
+      return;
     }
-    std::cout << "Cant find scope of " << s << "\n";
-    exit(1);
-    return ;
+    diag() << "Cant find scope of " << s << "\n";
+    compile_error();
   }
   int getSize(){
     return scopes.size();
   }
   int functionFirst = 1;
+
+  // The call graph, built by sem. routine is the routine whose body is
+  // being checked, nullptr in the main block.
+  SymbolEntry *routine = nullptr;
+  std::vector<SymbolEntry *> routines; // every routine defined, in order
+  void addCall(SymbolEntry *callee){
+    (routine ? routine->calls : mainCalls).push_back(callee);
+  }
+  // Effects of the routine being checked, the main block's are not needed.
+  void noteRead(){ if(routine) routine->readsMemory = true; }
+  void noteWrite(){ if(routine) routine->writesMemory = true; }
+  void noteLoop(){ if(routine) routine->mayLoop = true; }
+  void noteShared(){ if(routine) routine->reachesShared = true; }
+  // A variable of an enclosing routine used by the routine being checked.
+  void capture(SymbolEntry *v){
+    if(routine && v->owner && v->owner != routine) addCapture(routine, v);
+  }
+  // A routine also needs what its callees capture, but for its own variables.
+  void closeCaptures(){
+    bool changed = true;
+    while(changed){
+      changed = false;
+      for(SymbolEntry *r : routines)
+        for(SymbolEntry *c : r->calls)
+          for(size_t i = 0; i < c->captures.size(); ++i)
+            if(c->captures[i]->owner != r && addCapture(r, c->captures[i])) changed = true;
+    }
+  }
+  // A routine does what the routines it calls do. Effects only grow and
+  // returns only becomes true once every callee returns, so recursion never
+  // counts as returning.
+  void inferEffects(){
+    bool changed = true;
+    while(changed){
+      changed = false;
+      for(SymbolEntry *r : routines){
+        bool reads = r->readsMemory, writes = r->writesMemory, returns = !r->mayLoop;
+        bool shared = r->reachesShared;
+        for(SymbolEntry *c : r->calls){
+          reads = reads || c->readsMemory;
+          writes = writes || c->writesMemory;
+          returns = returns && c->returns;
+          shared = shared || c->reachesShared;
+        }
+        if(reads != r->readsMemory || writes != r->writesMemory || returns != r->returns ||
+           shared != r->reachesShared){
+          r->readsMemory = reads;
+          r->writesMemory = writes;
+          r->returns = returns;
+          r->reachesShared = shared;
+          changed = true;
+        }
+      }
+    }
+  }
+  // Every new, in the order sem met them. var is the variable it assigns,
+  // nullptr for any other l-value; count is 1 for new p, the constant n of
+  // new [n] p (brackets), or 0 when n is not a constant.
+  struct Allocation {
+    SymbolEntry *var;
+    SymbolEntry *routine;
+    OurType *type;
+    int count;
+    bool brackets;
+    bool onStack;
+  };
+  std::vector<Allocation> allocations;
+  size_t addAllocation(SymbolEntry *var, OurType *type, int count, bool brackets){
+    allocations.push_back(Allocation{ var, routine, type, count, brackets, false });
+    return allocations.size() - 1;
+  }
+  // The bytes of a value of type t, 0 when they are not known statically.
+  static long storageBytes(OurType *t){
+    switch(t ? t->val : TYPE_NIL){
+      case TYPE_INTEGER: return 4;
+      case TYPE_REAL: return 8;
+      case TYPE_BOOLEAN: case TYPE_CHAR: return 1;
+      case TYPE_POINTER: return 8;
+      case TYPE_ARRAY: return t->size > 0 ? t->size * storageBytes(t->oftype) : 0;
+      default: return 0;
+    }
+  }
+  // Escape analysis: the objects new makes for a local pointer variable
+  // that nothing copies, passes, returns or takes the address of can die
+  // with the routine's frame. They go on the stack when all of that
+  // variable's allocations have a size known here and small enough, and
+  // its disposes are dropped.
+  static const long maxStackAllocation = 4096;
+  void placeAllocations(){
+    std::map<SymbolEntry *, bool> fits;
+    for(const Allocation &a : allocations){
+      if(!a.var) continue;
+      SymbolEntry *v = a.var;
+      long bytes = a.count * storageBytes(a.type);
+      bool ok = v->local && !v->addressTaken && v->pointerUses == v->objectUses &&
+                bytes > 0 && bytes <= maxStackAllocation;
+      auto it = fits.find(v);
+      if(it == fits.end()) fits[v] = ok;
+      else it->second = it->second && ok;
+    }
+    for(Allocation &a : allocations){
+      if(a.var && fits[a.var]) a.onStack = a.var->onStack = true;
+    }
+  }
+  // Marks the routines the main block calls, directly or through others.
+  // Code generation skips the rest.
+  void markReachable(){
+    std::vector<SymbolEntry *> work(mainCalls);
+    while(!work.empty()){
+      SymbolEntry *e = work.back();
+      work.pop_back();
+      if(e->reachable) continue;
+      e->reachable = true;
+      work.insert(work.end(), e->calls.begin(), e->calls.end());
+    }
+  }
 private:
-  std::vector<Scope> scopes;
+  std::vector<SymbolEntry *> mainCalls;
+  static bool addCapture(SymbolEntry *r, SymbolEntry *v){
+    for(SymbolEntry *c : r->captures) if(c == v) return false;
+    r->captures.push_back(v);
+    return true;
+  }
+  struct Binding {
+    Scope *scope;
+    SymbolEntry *entry;
+  };
+  // Called after the innermost scope bound c.
+  void bind(const std::string &c){
+    bindings[c].push_back(Binding{ &scopes.back(), scopes.back().lookup(c) });
+    undo.back().push_back(c);
+  }
+  Binding *innermost(const std::string &c){
+    auto it = bindings.find(c);
+    if(it == bindings.end()) return declareBuiltin(c);
+    return &it->second.back();
+  }
+  // Library routines enter the outermost scope when first named, defined
+  // in ast.hpp where their formals can be built.
+  Binding *declareBuiltin(const std::string &c);
+  // Every entry of every scope, closed ones too: the tree keeps pointing
+  // at them until the next program replaces the table.
+  std::deque<SymbolEntry> entries;
+  // A deque never moves its elements, bindings point into the scopes.
+  std::deque<Scope> scopes;
+  std::vector<std::vector<std::string>> undo;
+  std::unordered_map<std::string, std::vector<Binding>> bindings;
 };
 
-extern SymbolTable st;
+extern thread_local SymbolTable st;